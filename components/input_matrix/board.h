@@ -0,0 +1,78 @@
+#ifndef _BOARD_H_
+#define _BOARD_H_
+
+/* Board definition. Everything else about the matrix (NCOL, NROW, the
+ * bitmap width and the GPIO register masks) is derived from these lists
+ * at compile time, see input_matrix.h. */
+
+/** @brief Matrix backends, select one with BOARD_BACKEND. */
+#define MATRIX_BACKEND_GPIO 0       // columns and rows on GPIO pins, see BOARD_COLS/BOARD_ROWS
+#define MATRIX_BACKEND_SHIFT_REG 1  // 74HC165 (and 74HC595) chains on the SPI bus, see BOARD_SR_*
+
+#define BOARD_BACKEND MATRIX_BACKEND_GPIO
+
+/** @brief Build the firmware for the left half, this mirrors the columns and selects the left keymap. */
+#define LEFT false
+
+/** @brief Column pins in keymap order, X(pin) per column. Columns are outputs and driven low one at a time. */
+#if LEFT
+#define BOARD_COLS(X) X(GPIO_NUM_25) X(GPIO_NUM_26) X(GPIO_NUM_13) X(GPIO_NUM_15) X(GPIO_NUM_14) X(GPIO_NUM_2)
+#else
+#define BOARD_COLS(X) X(GPIO_NUM_2) X(GPIO_NUM_14) X(GPIO_NUM_15) X(GPIO_NUM_13) X(GPIO_NUM_26) X(GPIO_NUM_25)
+#endif
+
+/** @brief Row pins in keymap order, X(pin) per row. Rows are inputs with pull-ups. */
+#define BOARD_ROWS(X) X(GPIO_NUM_16) X(GPIO_NUM_5) X(GPIO_NUM_4) X(GPIO_NUM_0) X(GPIO_NUM_3) X(GPIO_NUM_12)
+
+/** @brief Duplex matrix: every row/column crossing has two keys with opposite diodes.
+ *
+ * The first key of a crossing conducts when the column is driven low, the second one
+ * when the row is. The scan goes both ways, which doubles the keys on the same pins:
+ * column c of BOARD_COLS is bitmap column c for the first key and NCOL / 2 + c for the second. */
+#define BOARD_DUPLEX false
+
+/* Shift register backend. The 74HC165 chain is read over SPI with DMA, so
+ * the number of keys costs bus time instead of pins.
+ *
+ * BOARD_SR_DRIVE_COLS false: every key has its own 165 input, pressed keys
+ * pull it low. Input n of the chain (n = row * BOARD_SR_COLS + col) is pin
+ * D(n % 8) of the (n / 8)th 165, counted from the one whose QH drives MISO.
+ * The whole matrix is read with a single transaction.
+ *
+ * BOARD_SR_DRIVE_COLS true: a 74HC595 chain on MOSI drives the columns
+ * (output c of the chain, active low), the 165 chain reads the rows
+ * (input r, pulled up). Scanning takes one transaction per column. */
+#define BOARD_SR_DRIVE_COLS false
+#define BOARD_SR_COLS 16
+#define BOARD_SR_ROWS 8
+/** @brief SPI clock in Hz, the 74HC parts manage ~20MHz at 3.3V, the slower rate leaves room for long ribbon cables. */
+#define BOARD_SR_CLOCK_HZ (4 * 1000 * 1000)
+#define BOARD_SR_HOST SPI3_HOST
+#define BOARD_SR_SCLK GPIO_NUM_18   // 165 CP and 595 SRCLK
+#define BOARD_SR_MISO GPIO_NUM_19   // 165 QH
+#define BOARD_SR_MOSI GPIO_NUM_23   // 595 SER, only with BOARD_SR_DRIVE_COLS
+#define BOARD_SR_LOAD GPIO_NUM_17   // 165 PL, active low
+#define BOARD_SR_LATCH GPIO_NUM_21  // 595 RCLK, only with BOARD_SR_DRIVE_COLS
+/** @brief Read canned bytes from sr_mock_feed() instead of the SPI bus, for test_shift_reg() without the chains. */
+#define BOARD_SR_MOCK false
+
+/* MCP23017 I2C port expanders for a wired split half or extra keys, X(address)
+ * per chip, e.g. X(0x20) X(0x21). Every pin of a chip is one key to ground,
+ * expander input n (16 * chip + 8 for port B + pin) is column n % NCOL of row
+ * NROW_BACKEND + n / NCOL, after the rows of the backend (see input_matrix.h).
+ *
+ * The INT outputs are configured open drain and mirrored, so one wire-or'ed
+ * line to BOARD_EXPANDER_INT tells that any chip has seen a change. The bus is
+ * only read while that line is low. */
+#define BOARD_EXPANDERS(X)
+#define BOARD_EXPANDER_PORT I2C_NUM_0
+#define BOARD_EXPANDER_CLOCK_HZ (400 * 1000)
+#define BOARD_EXPANDER_SDA GPIO_NUM_32
+#define BOARD_EXPANDER_SCL GPIO_NUM_33
+#define BOARD_EXPANDER_INT GPIO_NUM_27
+/** @brief Answer the I2C transfers with simulated chips instead of the bus, for test_expander() without the chips.
+ *
+ * The simulated INT line does not wake matrix_backend_wait_for_key(). */
+#define BOARD_EXPANDER_SIM false
+
+#endif
@@ -0,0 +1,67 @@
+#include <string.h>
+
+#include "debounce.h"
+
+/** @brief Spread bit k of n over a whole word, so counters can be compared with n bitwise. */
+static void set_scans(matrix_row_t planes[3], int n){
+    for(int k = 0; k < 3; k++){
+        planes[k] = (n >> k) & 1 ? ~(matrix_row_t)0 : 0;
+    }
+}
+
+void debounce_init(debounce_t *db, debounce_algorithm_t algorithm, int press_scans, int release_scans){
+    memset(db, 0, sizeof(debounce_t));
+    db->algorithm = algorithm;
+    set_scans(db->press_scans, press_scans);
+    set_scans(db->release_scans, algorithm == DEBOUNCE_ASYM ? release_scans : press_scans);
+}
+
+/** @brief Increment the counters of the keys in mask, reset all others to 0. */
+static inline void count(matrix_row_t *c0, matrix_row_t *c1, matrix_row_t *c2, matrix_row_t mask){
+    matrix_row_t carry0 = *c0;
+    matrix_row_t carry1 = carry0 & *c1;
+    *c0 = ~*c0 & mask;
+    *c1 = (*c1 ^ carry0) & mask;
+    *c2 = (*c2 ^ carry1) & mask;
+}
+
+/** @brief Keys whose counter equals the bit-sliced value n. */
+static inline matrix_row_t equals(matrix_row_t c0, matrix_row_t c1, matrix_row_t c2, const matrix_row_t n[3]){
+    return ~((c0 ^ n[0]) | (c1 ^ n[1]) | (c2 ^ n[2]));
+}
+
+bool debounce_update(debounce_t *db, const matrix_row_t raw[NROW], matrix_row_t out[NROW]){
+    matrix_row_t changed = 0;
+    for(int i = 0; i < NROW; i++){
+        matrix_row_t *c0 = &db->counter[0][i];
+        matrix_row_t *c1 = &db->counter[1][i];
+        matrix_row_t *c2 = &db->counter[2][i];
+        matrix_row_t delta = raw[i] ^ db->state[i];
+        matrix_row_t flip;
+
+        if(db->algorithm == DEBOUNCE_EAGER){
+            // a running counter locks the key, free keys take the raw state right away
+            matrix_row_t locked = *c0 | *c1 | *c2;
+            flip = delta & ~locked;
+            count(c0, c1, c2, flip | locked);
+            matrix_row_t expired = equals(*c0, *c1, *c2, db->press_scans);
+            *c0 &= ~expired;
+            *c1 &= ~expired;
+            *c2 &= ~expired;
+        } else {
+            // counters run while the raw state differs and restart on every bounce
+            count(c0, c1, c2, delta);
+            flip = delta & ((raw[i] & equals(*c0, *c1, *c2, db->press_scans)) |
+                            (~raw[i] & equals(*c0, *c1, *c2, db->release_scans)));
+            // a flipped key counts from 0 again, or a revert right after would continue from n
+            *c0 &= ~flip;
+            *c1 &= ~flip;
+            *c2 &= ~flip;
+        }
+
+        db->state[i] ^= flip;
+        changed |= flip;
+        out[i] = db->state[i];
+    }
+    return changed != 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _DEBOUNCE_H_
+#define _DEBOUNCE_H_
+
+#include "input_matrix.h"
+
+typedef enum {
+    /** @brief Report a change on the first edge, then ignore the key for press_scans scans. */
+    DEBOUNCE_EAGER,
+    /** @brief Report a change once the key was stable for press_scans scans. */
+    DEBOUNCE_DEFER,
+    /** @brief Like DEBOUNCE_DEFER, but with press_scans for presses and release_scans for releases. */
+    DEBOUNCE_ASYM,
+} debounce_algorithm_t;
+
+/** @brief Highest press/release scan count, the counters are 3 bits wide. */
+#define DEBOUNCE_MAX_SCANS 7
+
+/** @brief Debouncer state for the whole matrix.
+ *
+ * Every key has a 3 bit counter, stored bit-sliced ("vertical"): bit n of
+ * counter[k][row] is bit k of the counter of the key in column n. That way
+ * one update handles a whole row with a handful of bitwise operations. */
+typedef struct {
+    debounce_algorithm_t algorithm;
+    matrix_row_t press_scans[3];
+    matrix_row_t release_scans[3];
+    matrix_row_t state[NROW];
+    matrix_row_t counter[3][NROW];
+} debounce_t;
+
+void debounce_init(debounce_t *db, debounce_algorithm_t algorithm, int press_scans, int release_scans);
+
+/** @brief Feed one raw scan, write the debounced state to out.
+ *
+ * @return true if any debounced key changed */
+bool debounce_update(debounce_t *db, const matrix_row_t raw[NROW], matrix_row_t out[NROW]);
+
+#endif
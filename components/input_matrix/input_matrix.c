@@ -1,35 +1,62 @@
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
-#include "driver/gpio.h"
+#include "esp_timer.h"
 
 #include "input_matrix.h"
+#include "matrix_backend.h"
+#include "debounce.h"
+#include "key_event.h"
 
-static const gpio_num_t col_pins[NCOL] = MATRIX_COLS;
-static const gpio_num_t row_pins[NROW] = MATRIX_ROWS;
+matrix_row_t input_matrix[NROW] = {0};
+
+#if INPUT_DEBOUNCE_PRESS_SCANS < 1 || INPUT_DEBOUNCE_PRESS_SCANS > DEBOUNCE_MAX_SCANS || \
+    INPUT_DEBOUNCE_RELEASE_SCANS < 1 || INPUT_DEBOUNCE_RELEASE_SCANS > DEBOUNCE_MAX_SCANS
+#error "INPUT_DEBOUNCE_PRESS_SCANS and INPUT_DEBOUNCE_RELEASE_SCANS must be between 1 and DEBOUNCE_MAX_SCANS"
+#endif
+
+static debounce_t debounce;
+static int64_t wake_time = 0;
 
-bool input_buttons[NBUTTON] = {false};
 void setup_input() {
-    for(int i = 0; i < NCOL; i++){
-        ESP_ERROR_CHECK(gpio_reset_pin(col_pins[i]));
-        ESP_ERROR_CHECK(gpio_set_direction(col_pins[i], GPIO_MODE_OUTPUT));
-    }
-    for(int i = 0; i < NROW; i++){
-        ESP_ERROR_CHECK(gpio_reset_pin(row_pins[i]));
-        ESP_ERROR_CHECK(gpio_set_direction(row_pins[i], GPIO_MODE_INPUT));
-        ESP_ERROR_CHECK(gpio_pullup_en(row_pins[i]));
-    }
+#if NEXPANDER
+    expander_setup();
+#endif
+    matrix_backend_setup();
+    debounce_init(&debounce, INPUT_DEBOUNCE, INPUT_DEBOUNCE_PRESS_SCANS, INPUT_DEBOUNCE_RELEASE_SCANS);
 }
+
 void scan_input(){
-    for(int i = 0; i < NCOL; i++){
-        for(int j = 0; j < NCOL; j++){
-            ESP_ERROR_CHECK(gpio_set_level(col_pins[j], i == j ? 0 : 1));
-        }
-        
-        vTaskDelay(1 / portTICK_PERIOD_MS);
+    int64_t time = esp_timer_get_time();
+    matrix_row_t state[NROW] = {0};
+    matrix_backend_read(state);
+#if NEXPANDER
+    expander_read(state);
+#endif
+    matrix_row_t prev[NROW];
+    for(int j = 0; j < NROW; j++){
+        prev[j] = input_matrix[j];
+    }
+    if(!debounce_update(&debounce, state, input_matrix)){
+        return;
+    }
 
-        for(int j = 0; j < NROW; j++){
-            int level = gpio_get_level(row_pins[j]);
-            input_buttons[j*NROW+i] = level > 0 ? 0 : 1;
+    // one event per changed key, all stamped with the time of this scan
+    key_event_t event = {.time = time};
+    for(int j = 0; j < NROW; j++){
+        for(matrix_row_t changed = input_matrix[j] ^ prev[j]; changed; changed &= changed - 1){
+            int col = __builtin_ctz(changed);
+            event.key = MATRIX_KEY(j, col);
+            event.pressed = (input_matrix[j] >> col) & 1;
+            key_event_push(&event);
         }
     }
-}
\ No newline at end of file
+    key_event_notify();
+}
+
+void input_wait_for_key(){
+    wake_time = matrix_backend_wait_for_key();
+}
+
+int64_t input_wake_time(){
+    return wake_time;
+}
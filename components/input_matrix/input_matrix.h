@@ -1,39 +1,101 @@
+#ifndef _INPUT_MATRIX_H_
+#define _INPUT_MATRIX_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
 #include "driver/gpio.h"
 
-#define LEFT false
-
-#define COL1 GPIO_NUM_2
-#define COL2 GPIO_NUM_14
-#define COL3 GPIO_NUM_15
-#define COL4 GPIO_NUM_13
-#define COL5 GPIO_NUM_26
-#define COL6 GPIO_NUM_25
-#define ROW1 GPIO_NUM_16
-#define ROW2 GPIO_NUM_5
-#define ROW3 GPIO_NUM_4
-#define ROW4 GPIO_NUM_0
-#define ROW5 GPIO_NUM_3
-#define ROW6 GPIO_NUM_12
-
-#if LEFT
-#define MATRIX_COLS                        \
-    {                                      \
-        COL6, COL5, COL4, COL3, COL2, COL1 \
-    }
+#include "board.h"
+
+// helpers to expand the BOARD_COLS/BOARD_ROWS lists
+#define MATRIX_COUNT(pin) +1
+#define MATRIX_PIN(pin) pin,
+#define MATRIX_BIT(pin) | (1ULL << (pin))
+
+/** @brief Matrix dimensions, counted from the board definition so they can be used in #if.
+ *
+ * The first NROW_BACKEND rows are scanned by the backend, the port expander keys
+ * follow in NROW_EXPANDER more rows of NCOL keys. */
+#if BOARD_BACKEND == MATRIX_BACKEND_GPIO
+#define NCOL_PINS (0 BOARD_COLS(MATRIX_COUNT))
+#if BOARD_DUPLEX
+#define NCOL (2 * NCOL_PINS)
+#else
+#define NCOL NCOL_PINS
+#endif
+#define NROW_BACKEND (0 BOARD_ROWS(MATRIX_COUNT))
 #else
-#define MATRIX_COLS                        \
-    {                                      \
-        COL1, COL2, COL3, COL4, COL5, COL6 \
-    }
+#define NCOL BOARD_SR_COLS
+#define NROW_BACKEND BOARD_SR_ROWS
 #endif
-#define MATRIX_ROWS                        \
-    {                                      \
-        ROW1, ROW2, ROW3, ROW4, ROW5, ROW6 \
-    }
-#define NCOL 6
-#define NROW 6
+#define NEXPANDER (0 BOARD_EXPANDERS(MATRIX_COUNT))
+#define NROW_EXPANDER ((NEXPANDER * 16 + NCOL - 1) / NCOL)
+#define NROW (NROW_BACKEND + NROW_EXPANDER)
 #define NBUTTON (NCOL * NROW)
-extern bool input_buttons[NBUTTON];
 
+/** @brief Time in microseconds the row inputs need to settle after a column has been driven.
+ *
+ * The GPIO backend measures the settle time of every column at boot and only uses this
+ * as upper bound, and as fallback for a column whose rows do not rise in time. */
+#define INPUT_SETTLE_US 5
+/** @brief Safety factor between the measured rise time of the rows and the settle time of a column. */
+#define INPUT_SETTLE_MARGIN 2
+/** @brief Number of full matrix scans per second, independent of the FreeRTOS tick rate. */
+#define INPUT_SCAN_RATE_HZ 1000
+/** @brief Scan period in microseconds, derived from INPUT_SCAN_RATE_HZ. */
+#define INPUT_SCAN_PERIOD_US (1000000 / INPUT_SCAN_RATE_HZ)
+/** @brief Time in milliseconds without any pressed key before the scanner goes idle. */
+#define INPUT_IDLE_TIMEOUT_MS 500
+/** @brief Poll period in milliseconds while idle, for backends that cannot wake on a key interrupt. */
+#define INPUT_IDLE_POLL_MS 10
+
+/** @brief Core of the scan and report tasks. Bluetooth is pinned to the other core, see sdkconfig.defaults. */
+#define INPUT_TASK_CORE APP_CPU_NUM
+/** @brief Priority of the scan task, above the report task so a report never delays a scan. */
+#define INPUT_SCAN_TASK_PRIORITY (configMAX_PRIORITIES - 2)
+
+/** @brief Debounce algorithm, see debounce_algorithm_t in debounce.h. */
+#define INPUT_DEBOUNCE DEBOUNCE_EAGER
+/** @brief Debounce time for presses (and releases, unless DEBOUNCE_ASYM) in scans, 1-7. */
+#define INPUT_DEBOUNCE_PRESS_SCANS 5
+/** @brief Debounce time for releases in scans with DEBOUNCE_ASYM, 1-7. */
+#define INPUT_DEBOUNCE_RELEASE_SCANS 5
+
+/** @brief Matrix state of one row, bit n is set while the key in column n is pressed.
+ *
+ * The narrowest type that holds NCOL bits, so the debouncer and the event
+ * generation work on as few bytes as possible. */
+#if NCOL <= 8
+typedef uint8_t matrix_row_t;
+#elif NCOL <= 16
+typedef uint16_t matrix_row_t;
+#elif NCOL <= 32
+typedef uint32_t matrix_row_t;
+#else
+#error "more than 32 columns, swap BOARD_COLS and BOARD_ROWS"
+#endif
+#if NBUTTON > 256
+#error "key indices have to fit in key_event_t.key"
+#endif
+/** @brief Key index of a matrix position, used to index the keymap. */
+#define MATRIX_KEY(row, col) ((row) * NCOL + (col))
+
+/** @brief Packed, debounced matrix state, one word per row.
+ *
+ * Only valid in the scanning task, other tasks get the changes as key events (key_event.h). */
+extern matrix_row_t input_matrix[NROW];
+
+/** @brief Scan and debounce the matrix, push a key event (key_event.h) for every change. */
 void scan_input();
-void setup_input();
\ No newline at end of file
+void setup_input();
+
+/** @brief Block the calling task until any key is pressed.
+ *
+ * The GPIO backend drives all columns and arms the row interrupts, no scanning happens
+ * while waiting. Backends without an interrupt poll every INPUT_IDLE_POLL_MS.
+ * Call scan_input() afterwards to get the actual matrix state. */
+void input_wait_for_key();
+/** @brief esp_timer timestamp of the key press that ended the last input_wait_for_key(). */
+int64_t input_wake_time();
+
+#endif
@@ -0,0 +1,55 @@
+#include "key_event.h"
+
+#if KEY_EVENT_QUEUE_LEN & (KEY_EVENT_QUEUE_LEN - 1)
+#error "KEY_EVENT_QUEUE_LEN must be a power of two"
+#endif
+
+// single producer, single consumer: head is only written by the scanner,
+// tail only by the reporter, so no lock is needed.
+static key_event_t events[KEY_EVENT_QUEUE_LEN];
+static uint32_t head = 0;
+static uint32_t tail = 0;
+static uint32_t high_water = 0;
+static uint32_t overflows = 0;
+static TaskHandle_t consumer = NULL;
+
+void key_event_set_consumer(TaskHandle_t task){
+    consumer = task;
+}
+
+bool key_event_push(const key_event_t *event){
+    uint32_t h = head;
+    uint32_t used = h - __atomic_load_n(&tail, __ATOMIC_ACQUIRE);
+    if(used >= KEY_EVENT_QUEUE_LEN){
+        overflows++;
+        return false;
+    }
+    events[h & (KEY_EVENT_QUEUE_LEN - 1)] = *event;
+    // publish the slot only after it has been written
+    __atomic_store_n(&head, h + 1, __ATOMIC_RELEASE);
+    if(used + 1 > high_water){
+        high_water = used + 1;
+    }
+    return true;
+}
+
+void key_event_notify(){
+    if(consumer != NULL){
+        xTaskNotifyGive(consumer);
+    }
+}
+
+bool key_event_pop(key_event_t *event){
+    uint32_t t = tail;
+    if(t == __atomic_load_n(&head, __ATOMIC_ACQUIRE)){
+        return false;
+    }
+    *event = events[t & (KEY_EVENT_QUEUE_LEN - 1)];
+    __atomic_store_n(&tail, t + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+void key_event_stats(uint32_t *high_water_out, uint32_t *overflows_out){
+    *high_water_out = high_water;
+    *overflows_out = overflows;
+}
@@ -0,0 +1,40 @@
+#ifndef _KEY_EVENT_H_
+#define _KEY_EVENT_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/** @brief Number of events the ring can hold, must be a power of two. */
+#define KEY_EVENT_QUEUE_LEN 64
+
+/** @brief A debounced press or release of one matrix key. */
+typedef struct {
+    /** @brief esp_timer timestamp in microseconds of the scan that saw the change. */
+    int64_t time;
+    /** @brief Matrix key index, see MATRIX_KEY(). */
+    uint8_t key;
+    bool pressed;
+} key_event_t;
+
+/** @brief Register the task that consumes events, it gets a task notification per batch. */
+void key_event_set_consumer(TaskHandle_t task);
+
+/** @brief Append an event, producer (scanner) side only.
+ *
+ * @return false if the ring was full and the event was dropped */
+bool key_event_push(const key_event_t *event);
+
+/** @brief Wake the consumer after one or more key_event_push() calls. */
+void key_event_notify();
+
+/** @brief Take the oldest event, consumer side only.
+ *
+ * @return false if the ring is empty */
+bool key_event_pop(key_event_t *event);
+
+/** @brief Highest number of events that were queued at once, and the number of dropped events. */
+void key_event_stats(uint32_t *high_water, uint32_t *overflows);
+
+#endif
@@ -0,0 +1,46 @@
+#ifndef _MATRIX_BACKEND_H_
+#define _MATRIX_BACKEND_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "input_matrix.h"
+
+/* Interface between input_matrix.c and the hardware specific matrix
+ * backends. Only the backend selected by BOARD_BACKEND is compiled. */
+
+void matrix_backend_setup();
+
+/** @brief Read the raw (not debounced) matrix, set the bits of all pressed keys in state. */
+void matrix_backend_read(matrix_row_t state[NROW]);
+
+/** @brief Block until any key is pressed.
+ *
+ * @return esp_timer timestamp of the moment the press was noticed */
+int64_t matrix_backend_wait_for_key();
+
+#if BOARD_BACKEND == MATRIX_BACKEND_SHIFT_REG && BOARD_SR_MOCK
+/** @brief Make the next ntransfers transfers shift in len bytes each from rx instead of the 165 chain.
+ *
+ * The bytes after len and all transfers after the last one read 0xff, every key released. */
+void sr_mock_feed(const uint8_t *rx, int ntransfers, int len);
+#endif
+
+#if NEXPANDER
+/* Port expanders, matrix_expander.c. They add their rows to any backend. */
+
+/** @brief Configure the expanders, call before matrix_backend_setup(). */
+void expander_setup();
+/** @brief Whether the INT line reports a change that has not been read yet. */
+bool expander_pending();
+/** @brief Set the bits of all pressed expander keys in state, reads the bus only if expander_pending(). */
+void expander_read(matrix_row_t state[NROW]);
+
+#if BOARD_EXPANDER_SIM
+/** @brief Set the inputs of simulated chip i whose keys are pressed, bit n for input n. */
+void expander_sim_set(int i, uint16_t pressed);
+/** @brief Make simulated chip i stop answering, or answer again from its power-on state. */
+void expander_sim_fail(int i, bool failed);
+#endif
+#endif
+
+#endif
@@ -0,0 +1,220 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "driver/gpio.h"
+#include "driver/i2c.h"
+#include "esp_log.h"
+#include "esp_timer.h"
+
+#include "input_matrix.h"
+#include "matrix_backend.h"
+
+#if NEXPANDER
+
+// MCP23017 registers with IOCON.BANK = 0, A and B ports interleaved
+#define MCP_IODIRA 0x00
+#define MCP_GPIOA 0x12
+#define MCP_IOCON_MIRROR 0x40
+#define MCP_IOCON_ODR 0x04
+
+#define EXPANDER_TIMEOUT pdMS_TO_TICKS(10)
+/** @brief Interval in microseconds to set up a chip again that stopped answering, e.g. an unplugged split half. */
+#define EXPANDER_RETRY_US 500000
+/** @brief Interval in microseconds to read chips with held keys without a change on INT, an unplugged chip never pulls it low. */
+#define EXPANDER_HELD_CHECK_US 100000
+
+static const char *TAG = "expander";
+
+static const uint8_t expander_addr[NEXPANDER] = {BOARD_EXPANDERS(MATRIX_PIN)};
+/** @brief Last read state of every chip, bit n is set while input n is pressed. */
+static uint16_t expander_keys[NEXPANDER];
+/** @brief Chips that failed to answer, their keys read released until a retry sets them up again. */
+static uint32_t expander_lost;
+_Static_assert(NEXPANDER <= 32, "expander_lost has a bit per chip");
+static int64_t expander_retry_time;
+static int64_t expander_check_time;
+
+// one sequential write from IODIRA to GPPUB per chip
+#define MCP_IOCON (MCP_IOCON_MIRROR | MCP_IOCON_ODR)
+static const uint8_t conf_regs[] = {
+    MCP_IODIRA,
+    0xff, 0xff, // IODIR: all inputs
+    0xff, 0xff, // IPOL: invert, a pressed key reads 1
+    0xff, 0xff, // GPINTEN: interrupt on change of every pin
+    0x00, 0x00, // DEFVAL: unused
+    0x00, 0x00, // INTCON: compare against the previous value
+    MCP_IOCON, MCP_IOCON,
+    0xff, 0xff, // GPPU: pull-ups
+};
+
+#if BOARD_EXPANDER_SIM
+#define MCP_IPOLA 0x02
+#define MCP_GPINTENA 0x04
+#define MCP_NREGS 0x16
+
+/** @brief Simulated chips: registers, the pins of the pressed keys and whether the chip answers. */
+static struct {
+    uint8_t regs[MCP_NREGS];
+    uint16_t pressed;
+    bool failed;
+    bool interrupt;
+} sim[NEXPANDER];
+
+void expander_sim_set(int i, uint16_t pressed){
+    uint16_t changed = sim[i].pressed ^ pressed;
+    sim[i].pressed = pressed;
+    if(changed & (sim[i].regs[MCP_GPINTENA] | sim[i].regs[MCP_GPINTENA + 1] << 8)){
+        sim[i].interrupt = true;
+    }
+}
+
+void expander_sim_fail(int i, bool failed){
+    // a chip that comes back has been powered off, it starts from its reset state
+    if(sim[i].failed && !failed){
+        memset(sim[i].regs, 0, sizeof(sim[i].regs));
+        sim[i].regs[MCP_IODIRA] = sim[i].regs[MCP_IODIRA + 1] = 0xff;
+        sim[i].interrupt = false;
+    }
+    sim[i].failed = failed;
+}
+
+/** @brief Write len bytes from the register in buf[0] on, the address increments like IOCON.SEQOP = 0. */
+static esp_err_t expander_write(int i, const uint8_t *buf, size_t len){
+    if(sim[i].failed){
+        return ESP_FAIL;
+    }
+    for(size_t n = 1; n < len && buf[0] + n - 1 < MCP_NREGS; n++){
+        sim[i].regs[buf[0] + n - 1] = buf[n];
+    }
+    return ESP_OK;
+}
+
+/** @brief Read the GPIO ports, the only registers read: keys pull their pin low, IPOL inverts the bits it is set for. */
+static esp_err_t expander_write_read(int i, uint8_t reg, uint8_t *in, size_t len){
+    if(sim[i].failed){
+        return ESP_FAIL;
+    }
+    uint16_t gpio = ~sim[i].pressed ^ (sim[i].regs[MCP_IPOLA] | sim[i].regs[MCP_IPOLA + 1] << 8);
+    for(size_t n = 0; n < len; n++){
+        in[n] = gpio >> 8 * ((reg + n - MCP_GPIOA) & 1);
+    }
+    sim[i].interrupt = false;
+    return ESP_OK;
+}
+#else
+static esp_err_t expander_write(int i, const uint8_t *buf, size_t len){
+    return i2c_master_write_to_device(BOARD_EXPANDER_PORT, expander_addr[i], buf, len, EXPANDER_TIMEOUT);
+}
+
+static esp_err_t expander_write_read(int i, uint8_t reg, uint8_t *in, size_t len){
+    return i2c_master_write_read_device(BOARD_EXPANDER_PORT, expander_addr[i], &reg, 1, in, len, EXPANDER_TIMEOUT);
+}
+#endif
+
+/** @brief Read both ports of chip i in one burst, this also clears its interrupt. */
+static bool expander_read_chip(int i){
+    uint8_t in[2];
+    if(expander_write_read(i, MCP_GPIOA, in, 2) != ESP_OK){
+        return false;
+    }
+    expander_keys[i] = in[0] | in[1] << 8;
+    return true;
+}
+
+/** @brief Mark chip i lost and release its keys, logged once per loss. */
+static void expander_lose(int i){
+    // a key held when the chip went away would stay pressed on the host
+    expander_keys[i] = 0;
+    if(!(expander_lost & 1u << i)){
+        ESP_LOGW(TAG, "expander 0x%02x does not answer, releasing its keys", expander_addr[i]);
+        expander_lost |= 1u << i;
+        expander_retry_time = esp_timer_get_time() + EXPANDER_RETRY_US;
+    }
+}
+
+/** @brief Configure chip i and read its state. */
+static void expander_setup_chip(int i){
+    if(expander_write(i, conf_regs, sizeof(conf_regs)) != ESP_OK || !expander_read_chip(i)){
+        expander_lose(i);
+    } else if(expander_lost & 1u << i){
+        ESP_LOGI(TAG, "expander 0x%02x is back", expander_addr[i]);
+        expander_lost &= ~(1u << i);
+    }
+}
+
+void expander_setup(){
+#if BOARD_EXPANDER_SIM
+    for(int i = 0; i < NEXPANDER; i++){
+        sim[i].failed = true;
+        expander_sim_fail(i, false);
+    }
+#else
+    i2c_config_t conf = {
+        .mode = I2C_MODE_MASTER,
+        .sda_io_num = BOARD_EXPANDER_SDA,
+        .scl_io_num = BOARD_EXPANDER_SCL,
+        .sda_pullup_en = GPIO_PULLUP_ENABLE,
+        .scl_pullup_en = GPIO_PULLUP_ENABLE,
+        .master.clk_speed = BOARD_EXPANDER_CLOCK_HZ,
+    };
+    ESP_ERROR_CHECK(i2c_param_config(BOARD_EXPANDER_PORT, &conf));
+    ESP_ERROR_CHECK(i2c_driver_install(BOARD_EXPANDER_PORT, I2C_MODE_MASTER, 0, 0, 0));
+
+    // the INT outputs are open drain
+    ESP_ERROR_CHECK(gpio_reset_pin(BOARD_EXPANDER_INT));
+    ESP_ERROR_CHECK(gpio_set_direction(BOARD_EXPANDER_INT, GPIO_MODE_INPUT));
+    ESP_ERROR_CHECK(gpio_pullup_en(BOARD_EXPANDER_INT));
+#endif
+
+    for(int i = 0; i < NEXPANDER; i++){
+        expander_setup_chip(i);
+    }
+}
+
+bool expander_pending(){
+#if BOARD_EXPANDER_SIM
+    // the INT outputs are wire-or'ed, any chip pulls the line low
+    for(int i = 0; i < NEXPANDER; i++){
+        if(sim[i].interrupt && !sim[i].failed){
+            return true;
+        }
+    }
+    return false;
+#else
+    return !gpio_get_level(BOARD_EXPANDER_INT);
+#endif
+}
+
+void expander_read(matrix_row_t state[NROW]){
+    int64_t now = esp_timer_get_time();
+    bool check = now >= expander_check_time;
+    if(check){
+        expander_check_time = now + EXPANDER_HELD_CHECK_US;
+    }
+    // the INT line stays low until the changed chip has been read, so a change
+    // that happens during the reads is seen on the next scan
+    bool pending = expander_pending();
+    if(pending || check){
+        for(int i = 0; i < NEXPANDER; i++){
+            if(!(expander_lost & 1u << i) && (pending || expander_keys[i]) && !expander_read_chip(i)){
+                expander_lose(i);
+            }
+        }
+    }
+    // a chip that comes back may have lost its configuration, it is set up again
+    if(expander_lost && now >= expander_retry_time){
+        expander_retry_time = now + EXPANDER_RETRY_US;
+        for(int i = 0; i < NEXPANDER; i++){
+            if(expander_lost & 1u << i){
+                expander_setup_chip(i);
+            }
+        }
+    }
+    for(int i = 0; i < NEXPANDER; i++){
+        for(uint32_t keys = expander_keys[i]; keys; keys &= keys - 1){
+            int n = i * 16 + __builtin_ctz(keys);
+            state[NROW_BACKEND + n / NCOL] |= (matrix_row_t)1 << (n % NCOL);
+        }
+    }
+}
+
+#endif
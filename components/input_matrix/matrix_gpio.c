@@ -0,0 +1,382 @@
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "soc/gpio_struct.h"
+#include "esp_cpu.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+#include "esp_log.h"
+
+#include "input_matrix.h"
+#include "matrix_backend.h"
+
+#if BOARD_BACKEND == MATRIX_BACKEND_GPIO
+
+static const char *TAG = "input_matrix";
+
+// settle time calibration, see calibrate_settle()
+#define CALIBRATE_RUNS 16
+#define CALIBRATE_STABLE_READS 4
+
+static const gpio_num_t col_pins[NCOL_PINS] = {BOARD_COLS(MATRIX_PIN)};
+static const gpio_num_t row_pins[NROW_BACKEND] = {BOARD_ROWS(MATRIX_PIN)};
+
+// check the board definition
+#define ASSERT_COL_PIN(pin) _Static_assert(GPIO_IS_VALID_OUTPUT_GPIO(pin), #pin " cannot drive a column");
+#define ASSERT_ROW_PIN(pin) _Static_assert(GPIO_IS_VALID_GPIO(pin), #pin " is not a valid row pin");
+BOARD_COLS(ASSERT_COL_PIN)
+#if BOARD_DUPLEX
+// duplex rows are driven as well
+#undef ASSERT_ROW_PIN
+#define ASSERT_ROW_PIN(pin) _Static_assert(GPIO_IS_VALID_OUTPUT_GPIO(pin), #pin " cannot drive a duplex row");
+#endif
+BOARD_ROWS(ASSERT_ROW_PIN)
+_Static_assert(((0 BOARD_COLS(MATRIX_BIT)) & (0 BOARD_ROWS(MATRIX_BIT))) == 0, "a pin is used as column and row");
+_Static_assert(__builtin_popcountll(0 BOARD_COLS(MATRIX_BIT)) == NCOL_PINS, "a column pin is listed twice");
+_Static_assert(__builtin_popcountll(0 BOARD_ROWS(MATRIX_BIT)) == NROW_BACKEND, "a row pin is listed twice");
+#if NEXPANDER
+_Static_assert(!((0 BOARD_COLS(MATRIX_BIT) BOARD_ROWS(MATRIX_BIT)) & (1ULL << BOARD_EXPANDER_INT)),
+               "BOARD_EXPANDER_INT is used by the matrix");
+#endif
+
+// pin-to-bit tables for the GPIO registers, pins 0-31 in *_lo, 32-39 in *_hi.
+// All of them are constants, so the scan loops unroll and the unused bank drops out.
+#define LO_BIT(pin) (pin < 32 ? (uint32_t)(1ULL << (pin)) : 0),
+#define HI_BIT(pin) (pin < 32 ? 0 : (uint32_t)(1ULL << ((pin) - 32))),
+#define ROW_BIT(pin) (1ULL << (pin)),
+static const uint32_t col_bits_lo[NCOL_PINS] = {BOARD_COLS(LO_BIT)};
+static const uint32_t col_bits_hi[NCOL_PINS] = {BOARD_COLS(HI_BIT)};
+static const uint64_t row_bits[NROW_BACKEND] = {BOARD_ROWS(ROW_BIT)};
+static const uint32_t col_mask_lo = (uint32_t)(0 BOARD_COLS(MATRIX_BIT));
+static const uint32_t col_mask_hi = (uint32_t)((0 BOARD_COLS(MATRIX_BIT)) >> 32);
+#if BOARD_DUPLEX
+// the columns are inputs of the backward scan
+static const uint32_t row_mask_lo = (uint32_t)(0 BOARD_ROWS(MATRIX_BIT));
+static const uint32_t row_mask_hi = (uint32_t)((0 BOARD_ROWS(MATRIX_BIT)) >> 32);
+static const bool rows_hi = ((0 BOARD_ROWS(MATRIX_BIT) BOARD_COLS(MATRIX_BIT)) >> 32) != 0;
+#else
+static const bool rows_hi = ((0 BOARD_ROWS(MATRIX_BIT)) >> 32) != 0;
+#endif
+
+static TaskHandle_t idle_task = NULL;
+static volatile int64_t idle_wake_time = 0;
+
+/** @brief Disarm every interrupt that wakes matrix_backend_wait_for_key(). */
+static void IRAM_ATTR wake_intr_disable(){
+    for(int i = 0; i < NROW_BACKEND; i++){
+        gpio_intr_disable(row_pins[i]);
+    }
+#if BOARD_DUPLEX
+    for(int i = 0; i < NCOL_PINS; i++){
+        gpio_intr_disable(col_pins[i]);
+    }
+#endif
+#if NEXPANDER
+    gpio_intr_disable(BOARD_EXPANDER_INT);
+#endif
+}
+
+/** @brief Row (or expander) interrupt while idle: disarm all rows and wake the task blocked in matrix_backend_wait_for_key(). */
+static void IRAM_ATTR row_isr(void *arg){
+    BaseType_t woken = pdFALSE;
+    wake_intr_disable();
+    // the first interrupt of a wait sets the time, a late one must not move it
+    if(!idle_wake_time){
+        idle_wake_time = esp_timer_get_time();
+    }
+    vTaskNotifyGiveFromISR(idle_task, &woken);
+    if(woken){
+        portYIELD_FROM_ISR();
+    }
+}
+
+#if BOARD_DUPLEX
+/** @brief Set up a duplex pin: pulled up, output latch low, driven only while its output is enabled. */
+static void setup_duplex_pin(gpio_num_t pin){
+    ESP_ERROR_CHECK(gpio_reset_pin(pin));
+    ESP_ERROR_CHECK(gpio_set_level(pin, 0));
+    ESP_ERROR_CHECK(gpio_set_direction(pin, GPIO_MODE_INPUT_OUTPUT));
+    ESP_ERROR_CHECK(gpio_pullup_en(pin));
+    ESP_ERROR_CHECK(gpio_set_intr_type(pin, GPIO_INTR_LOW_LEVEL));
+    ESP_ERROR_CHECK(gpio_intr_disable(pin));
+}
+
+/** @brief Drive the pins in lo/hi low, release all other matrix pins to their pull-ups.
+ *
+ * A released line must not be driven high: it would fight a line driven low through
+ * the two diodes of a crossing with both keys pressed. Switching between output and
+ * input is one write to the output enable register per bank. */
+static inline void drive_pins(uint32_t lo, uint32_t hi){
+    GPIO.enable_w1tc = (col_mask_lo | row_mask_lo) & ~lo;
+    GPIO.enable_w1ts = lo;
+    if(col_mask_hi | row_mask_hi){
+        GPIO.enable1_w1tc.val = (col_mask_hi | row_mask_hi) & ~hi;
+        GPIO.enable1_w1ts.val = hi;
+    }
+}
+#endif
+
+#if !BOARD_DUPLEX
+/** @brief Drive column i low and all other columns high with one register write per bank. */
+static inline void drive_col(int i){
+    GPIO.out_w1ts = col_mask_lo & ~col_bits_lo[i];
+    GPIO.out_w1tc = col_bits_lo[i];
+    if(col_mask_hi){
+        GPIO.out1_w1ts.val = col_mask_hi & ~col_bits_hi[i];
+        GPIO.out1_w1tc.val = col_bits_hi[i];
+    }
+}
+#endif
+
+/** @brief Read all row (and in a duplex matrix column) pins at once, pins 32-39 are only read if one of them uses them. */
+static inline uint64_t read_rows(){
+    uint64_t in = GPIO.in;
+    if(rows_hi){
+        in |= (uint64_t)GPIO.in1.data << 32;
+    }
+    return in;
+}
+
+/** @brief Settle time of every drive step of a scan in CPU cycles, see calibrate_settle(). */
+#if BOARD_DUPLEX
+static uint32_t settle_cycles[NCOL_PINS + NROW_BACKEND];
+#else
+static uint32_t settle_cycles[NCOL_PINS];
+#endif
+
+static inline void settle(int step){
+    uint32_t start = esp_cpu_get_ccount();
+    while(esp_cpu_get_ccount() - start < settle_cycles[step]);
+}
+
+/** @brief Discharge the inputs in in_lo/in_hi and measure how long they take to read high again.
+ *
+ * The inputs have to be set up with output latch 0, so enabling their output pulls them low.
+ * @return rise time in CPU cycles, 0 if an input is still low after INPUT_SETTLE_US, e.g. a pressed key holds it */
+static uint32_t measure_rise(uint32_t in_lo, uint32_t in_hi){
+    const uint64_t mask = in_lo | (uint64_t)in_hi << 32;
+    const uint32_t timeout = INPUT_SETTLE_US * esp_rom_get_cpu_ticks_per_us();
+
+    GPIO.enable_w1ts = in_lo;
+    if(in_hi){
+        GPIO.enable1_w1ts.val = in_hi;
+    }
+    esp_rom_delay_us(1);
+
+    uint32_t start = esp_cpu_get_ccount();
+    GPIO.enable_w1tc = in_lo;
+    if(in_hi){
+        GPIO.enable1_w1tc.val = in_hi;
+    }
+    // the first high reading only counts if it holds, a line can ring past the threshold
+    uint32_t rise = 0;
+    int stable = 0;
+    for(uint32_t t = 0; t < timeout; t = esp_cpu_get_ccount() - start){
+        if((read_rows() & mask) != mask){
+            stable = 0;
+        }else if(stable++ == 0){
+            rise = t;
+        }else if(stable == CALIBRATE_STABLE_READS){
+            return rise ? rise : 1;
+        }
+    }
+    return 0;
+}
+
+/** @brief Settle time of one drive step: the worst of CALIBRATE_RUNS rise times times INPUT_SETTLE_MARGIN,
+ * INPUT_SETTLE_US if the inputs do not rise in time. */
+static uint32_t calibrate_step(uint32_t in_lo, uint32_t in_hi){
+    const uint32_t fallback = INPUT_SETTLE_US * esp_rom_get_cpu_ticks_per_us();
+    uint32_t worst = 0;
+    for(int run = 0; run < CALIBRATE_RUNS; run++){
+        uint32_t rise = measure_rise(in_lo, in_hi);
+        if(!rise){
+            return fallback;
+        }
+        if(rise > worst){
+            worst = rise;
+        }
+    }
+    return worst * INPUT_SETTLE_MARGIN < fallback ? worst * INPUT_SETTLE_MARGIN : fallback;
+}
+
+/** @brief Measure the settle time of every drive step of a scan.
+ *
+ * A scan has to wait until the rows a pressed key of the previous column pulled low
+ * have risen again through their pull-ups. That depends on pull-up strength and trace
+ * capacitance, so it is measured here for every column with the column driven. */
+static void calibrate_settle(){
+    const uint32_t row_lo = (uint32_t)(0 BOARD_ROWS(MATRIX_BIT));
+    const uint32_t row_hi = (uint32_t)((0 BOARD_ROWS(MATRIX_BIT)) >> 32);
+#if BOARD_DUPLEX
+    for(int i = 0; i < NCOL_PINS; i++){
+        drive_pins(col_bits_lo[i], col_bits_hi[i]);
+        esp_rom_delay_us(INPUT_SETTLE_US);
+        settle_cycles[i] = calibrate_step(row_lo, row_hi);
+    }
+    for(int j = 0; j < NROW_BACKEND; j++){
+        drive_pins((uint32_t)row_bits[j], (uint32_t)(row_bits[j] >> 32));
+        esp_rom_delay_us(INPUT_SETTLE_US);
+        settle_cycles[NCOL_PINS + j] = calibrate_step(col_mask_lo, col_mask_hi);
+    }
+    drive_pins(0, 0);
+#else
+    // the rows are plain inputs, give them an output latch to discharge them with
+    for(int j = 0; j < NROW_BACKEND; j++){
+        ESP_ERROR_CHECK(gpio_set_level(row_pins[j], 0));
+        ESP_ERROR_CHECK(gpio_set_direction(row_pins[j], GPIO_MODE_INPUT_OUTPUT));
+    }
+    for(int i = 0; i < NCOL; i++){
+        drive_col(i);
+        esp_rom_delay_us(INPUT_SETTLE_US);
+        settle_cycles[i] = calibrate_step(row_lo, row_hi);
+    }
+    for(int j = 0; j < NROW_BACKEND; j++){
+        ESP_ERROR_CHECK(gpio_set_direction(row_pins[j], GPIO_MODE_INPUT));
+    }
+#endif
+    for(int i = 0; i < sizeof(settle_cycles) / sizeof(settle_cycles[0]); i++){
+        ESP_LOGI(TAG, "settle time of step %d: %dns", i,
+                 (int)(settle_cycles[i] * 1000 / esp_rom_get_cpu_ticks_per_us()));
+    }
+}
+
+void matrix_backend_setup(){
+#if BOARD_DUPLEX
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    for(int i = 0; i < NCOL_PINS; i++){
+        setup_duplex_pin(col_pins[i]);
+        ESP_ERROR_CHECK(gpio_isr_handler_add(col_pins[i], row_isr, NULL));
+    }
+    for(int i = 0; i < NROW_BACKEND; i++){
+        setup_duplex_pin(row_pins[i]);
+        ESP_ERROR_CHECK(gpio_isr_handler_add(row_pins[i], row_isr, NULL));
+    }
+    drive_pins(0, 0);
+#else
+    for(int i = 0; i < NCOL; i++){
+        ESP_ERROR_CHECK(gpio_reset_pin(col_pins[i]));
+        ESP_ERROR_CHECK(gpio_set_direction(col_pins[i], GPIO_MODE_OUTPUT));
+        ESP_ERROR_CHECK(gpio_set_level(col_pins[i], 1));
+    }
+    for(int i = 0; i < NROW_BACKEND; i++){
+        ESP_ERROR_CHECK(gpio_reset_pin(row_pins[i]));
+        ESP_ERROR_CHECK(gpio_set_direction(row_pins[i], GPIO_MODE_INPUT));
+        ESP_ERROR_CHECK(gpio_pullup_en(row_pins[i]));
+    }
+    ESP_ERROR_CHECK(gpio_install_isr_service(0));
+    for(int i = 0; i < NROW_BACKEND; i++){
+        ESP_ERROR_CHECK(gpio_set_intr_type(row_pins[i], GPIO_INTR_LOW_LEVEL));
+        ESP_ERROR_CHECK(gpio_intr_disable(row_pins[i]));
+        ESP_ERROR_CHECK(gpio_isr_handler_add(row_pins[i], row_isr, NULL));
+    }
+#endif
+#if NEXPANDER
+    // the expander keys are not driven by the columns, their INT line wakes up separately
+    ESP_ERROR_CHECK(gpio_set_intr_type(BOARD_EXPANDER_INT, GPIO_INTR_LOW_LEVEL));
+    ESP_ERROR_CHECK(gpio_intr_disable(BOARD_EXPANDER_INT));
+    ESP_ERROR_CHECK(gpio_isr_handler_add(BOARD_EXPANDER_INT, row_isr, NULL));
+#endif
+    calibrate_settle();
+}
+
+#if BOARD_DUPLEX
+void matrix_backend_read(matrix_row_t state[NROW]){
+    // forward: column i low, the first key of a pressed crossing pulls its row low
+    for(int i = 0; i < NCOL_PINS; i++){
+        drive_pins(col_bits_lo[i], col_bits_hi[i]);
+        settle(i);
+        uint64_t in = read_rows();
+        for(int j = 0; j < NROW_BACKEND; j++){
+            if(!(in & row_bits[j])){
+                state[j] |= (matrix_row_t)1 << i;
+            }
+        }
+    }
+    // backward: row j low, the second key pulls its column low
+    for(int j = 0; j < NROW_BACKEND; j++){
+        drive_pins((uint32_t)row_bits[j], (uint32_t)(row_bits[j] >> 32));
+        settle(NCOL_PINS + j);
+        uint64_t in = read_rows();
+        for(int i = 0; i < NCOL_PINS; i++){
+            if(!(in & (col_bits_lo[i] | (uint64_t)col_bits_hi[i] << 32))){
+                state[j] |= (matrix_row_t)1 << (NCOL_PINS + i);
+            }
+        }
+    }
+}
+#else
+void matrix_backend_read(matrix_row_t state[NROW]){
+    for(int i = 0; i < NCOL; i++){
+        drive_col(i);
+
+        // busy-wait: a tick based delay is either 0 or a whole tick (10ms) long
+        settle(i);
+
+        uint64_t in = read_rows();
+        for(int j = 0; j < NROW_BACKEND; j++){
+            // rows are pulled up, a pressed key pulls its row low
+            if(!(in & row_bits[j])){
+                state[j] |= (matrix_row_t)1 << i;
+            }
+        }
+    }
+}
+#endif
+
+int64_t matrix_backend_wait_for_key(){
+    idle_task = xTaskGetCurrentTaskHandle();
+    idle_wake_time = 0;
+    // drop a notification that may still be pending from the scan timer
+    ulTaskNotifyTake(pdTRUE, 0);
+#if NEXPANDER
+    gpio_intr_enable(BOARD_EXPANDER_INT);
+#endif
+
+#if BOARD_DUPLEX
+    // a crossing only pulls an input low in one direction, so alternate between
+    // driving all columns and all rows until one of the inputs fires
+    for(bool backward = false; ; backward = !backward){
+        const gpio_num_t *pins = backward ? col_pins : row_pins;
+        int n = backward ? NCOL_PINS : NROW_BACKEND;
+        if(backward){
+            drive_pins(row_mask_lo, row_mask_hi);
+        }else{
+            drive_pins(col_mask_lo, col_mask_hi);
+        }
+        esp_rom_delay_us(INPUT_SETTLE_US);
+        for(int i = 0; i < n; i++){
+            gpio_intr_enable(pins[i]);
+        }
+        if(ulTaskNotifyTake(pdTRUE, pdMS_TO_TICKS(INPUT_IDLE_POLL_MS))){
+            break;
+        }
+        // an interrupt right after the timeout leaves its notification pending,
+        // the next ulTaskNotifyTake() returns immediately then
+        for(int i = 0; i < n; i++){
+            gpio_intr_disable(pins[i]);
+        }
+    }
+#else
+    // drive all columns, then any pressed key pulls its row low
+    GPIO.out_w1tc = col_mask_lo;
+    if(col_mask_hi){
+        GPIO.out1_w1tc.val = col_mask_hi;
+    }
+    esp_rom_delay_us(INPUT_SETTLE_US);
+
+    // level triggered, so a key that is already down wakes us immediately
+    for(int i = 0; i < NROW_BACKEND; i++){
+        gpio_intr_enable(row_pins[i]);
+    }
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+#endif
+    // the wake may come from a notification left by an earlier poll of the duplex loop,
+    // with the inputs armed since still enabled: they would fire during the scans
+    wake_intr_disable();
+    // and drop the notification of an interrupt that fired before the disable
+    ulTaskNotifyTake(pdTRUE, 0);
+    return idle_wake_time;
+}
+
+#endif
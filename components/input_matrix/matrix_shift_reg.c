@@ -0,0 +1,234 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "driver/gpio.h"
+#include "driver/spi_master.h"
+#include "soc/gpio_struct.h"
+#include "esp_attr.h"
+#include "esp_rom_sys.h"
+#include "esp_timer.h"
+
+#include "input_matrix.h"
+#include "matrix_backend.h"
+
+#if BOARD_BACKEND == MATRIX_BACKEND_SHIFT_REG
+
+_Static_assert(BOARD_SR_LOAD < 32 && (!BOARD_SR_DRIVE_COLS || BOARD_SR_LATCH < 32),
+               "BOARD_SR_LOAD and BOARD_SR_LATCH are pulsed through the GPIO.out register");
+
+#if BOARD_SR_DRIVE_COLS
+#define SR_OUT_BYTES ((NCOL + 7) / 8)   // 595 chain
+#define SR_IN_BYTES ((NROW_BACKEND + 7) / 8)    // 165 chain
+#if NROW_BACKEND > 32
+#error "more than 32 rows, swap BOARD_SR_COLS and BOARD_SR_ROWS"
+#endif
+#else
+#if NCOL % 8
+#error "BOARD_SR_COLS has to be a multiple of 8 so every row starts on a byte boundary"
+#endif
+#define SR_OUT_BYTES 0
+#define SR_IN_BYTES (NROW_BACKEND * NCOL / 8)
+/** @brief The NCOL bits of a row, matrix_row_t can be wider, e.g. 32 bits for 24 columns. */
+#define SR_ROW_MASK ((matrix_row_t)~(matrix_row_t)0 >> (8 * sizeof(matrix_row_t) - NCOL))
+#endif
+/** @brief Transaction length in bytes, both chains are clocked together. */
+#define SR_BYTES (SR_OUT_BYTES > SR_IN_BYTES ? SR_OUT_BYTES : SR_IN_BYTES)
+
+#if !BOARD_SR_MOCK
+static spi_device_handle_t sr_dev;
+#endif
+// DMA reads and writes whole words
+static WORD_ALIGNED_ATTR DMA_ATTR uint8_t sr_rx[(SR_BYTES + 3) & ~3];
+#if BOARD_SR_DRIVE_COLS
+// one column pattern per column and the all-high pattern to end a scan
+static WORD_ALIGNED_ATTR DMA_ATTR uint8_t sr_tx[NCOL + 1][(SR_BYTES + 3) & ~3];
+static WORD_ALIGNED_ATTR DMA_ATTR uint8_t sr_tx_idle[(SR_BYTES + 3) & ~3];
+#endif
+
+/** @brief Pulse 165 PL low, the chain samples its parallel inputs. */
+static inline void sr_load(){
+    GPIO.out_w1tc = 1UL << BOARD_SR_LOAD;
+    GPIO.out_w1ts = 1UL << BOARD_SR_LOAD;
+}
+
+#if BOARD_SR_DRIVE_COLS
+/** @brief Pulse 595 RCLK high, the chain drives the pattern shifted in last. */
+static inline void sr_latch(){
+    GPIO.out_w1ts = 1UL << BOARD_SR_LATCH;
+    GPIO.out_w1tc = 1UL << BOARD_SR_LATCH;
+}
+
+/** @brief Fill buf with the 595 pattern that drives the columns in low_cols low and all others high.
+ *
+ * The last byte shifted out ends up in the 595 next to the MCU, so column c is bit c % 8
+ * of byte SR_BYTES - 1 - c / 8. */
+static void sr_pattern(uint8_t *buf, uint64_t low_cols){
+    memset(buf, 0xff, SR_BYTES);
+    for(int c = 0; c < NCOL; c++){
+        if(low_cols & (1ULL << c)){
+            buf[SR_BYTES - 1 - c / 8] &= ~(1 << (c % 8));
+        }
+    }
+}
+#endif
+
+#if BOARD_SR_MOCK
+static const uint8_t *sr_mock_rx;
+static int sr_mock_transfers, sr_mock_len;
+
+void sr_mock_feed(const uint8_t *rx, int ntransfers, int len){
+    sr_mock_rx = rx;
+    sr_mock_transfers = ntransfers;
+    sr_mock_len = len < SR_BYTES ? len : SR_BYTES;
+}
+#endif
+
+/** @brief Shift tx (may be NULL) out while sr_rx is shifted in. */
+static inline void sr_transfer(const uint8_t *tx){
+#if BOARD_SR_MOCK
+    memset(sr_rx, 0xff, sizeof(sr_rx));
+    if(sr_mock_transfers > 0){
+        memcpy(sr_rx, sr_mock_rx, sr_mock_len);
+        sr_mock_rx += sr_mock_len;
+        sr_mock_transfers--;
+    }
+#else
+    spi_transaction_t t = {
+        .length = SR_BYTES * 8,
+        .tx_buffer = tx,
+        .rx_buffer = sr_rx,
+    };
+    // polling instead of queueing: the transfer takes a few microseconds,
+    // less than the two context switches of an interrupt driven transaction
+    ESP_ERROR_CHECK(spi_device_polling_transmit(sr_dev, &t));
+#endif
+}
+
+void matrix_backend_setup(){
+    ESP_ERROR_CHECK(gpio_reset_pin(BOARD_SR_LOAD));
+    ESP_ERROR_CHECK(gpio_set_direction(BOARD_SR_LOAD, GPIO_MODE_OUTPUT));
+    ESP_ERROR_CHECK(gpio_set_level(BOARD_SR_LOAD, 1));
+#if BOARD_SR_DRIVE_COLS
+    ESP_ERROR_CHECK(gpio_reset_pin(BOARD_SR_LATCH));
+    ESP_ERROR_CHECK(gpio_set_direction(BOARD_SR_LATCH, GPIO_MODE_OUTPUT));
+    ESP_ERROR_CHECK(gpio_set_level(BOARD_SR_LATCH, 0));
+#endif
+
+#if !BOARD_SR_MOCK
+    spi_bus_config_t bus = {
+        .miso_io_num = BOARD_SR_MISO,
+        .mosi_io_num = BOARD_SR_DRIVE_COLS ? BOARD_SR_MOSI : -1,
+        .sclk_io_num = BOARD_SR_SCLK,
+        .quadwp_io_num = -1,
+        .quadhd_io_num = -1,
+        .max_transfer_sz = sizeof(sr_rx),
+    };
+    ESP_ERROR_CHECK(spi_bus_initialize(BOARD_SR_HOST, &bus, SPI_DMA_CH_AUTO));
+    spi_device_interface_config_t dev = {
+        .clock_speed_hz = BOARD_SR_CLOCK_HZ,
+        .mode = 0,
+        .spics_io_num = -1,
+        .queue_size = 1,
+    };
+    ESP_ERROR_CHECK(spi_bus_add_device(BOARD_SR_HOST, &dev, &sr_dev));
+    // the scanner is the only user of the bus, keep it instead of arbitrating every transfer
+    ESP_ERROR_CHECK(spi_device_acquire_bus(sr_dev, portMAX_DELAY));
+#endif
+
+#if BOARD_SR_DRIVE_COLS
+    for(int c = 0; c < NCOL; c++){
+        sr_pattern(sr_tx[c], 1ULL << c);
+    }
+    sr_pattern(sr_tx[NCOL], 0);
+    sr_pattern(sr_tx_idle, ~0ULL);
+    // release all columns
+    sr_transfer(sr_tx[NCOL]);
+    sr_latch();
+#endif
+}
+
+#if BOARD_SR_DRIVE_COLS
+/** @brief Rows of the last load, bit r is set while row r is pulled low. */
+static inline uint32_t sr_rows(){
+    uint32_t rows = 0;
+    for(int i = 0; i < SR_IN_BYTES; i++){
+        rows |= (uint32_t)sr_rx[i] << (8 * i);
+    }
+    return ~rows & ((1ULL << NROW_BACKEND) - 1);
+}
+
+void matrix_backend_read(matrix_row_t state[NROW]){
+    // pipelined: every transfer shifts the next column pattern into the 595s
+    // while it reads the rows of the column driven now
+    sr_transfer(sr_tx[0]);
+    for(int c = 0; c < NCOL; c++){
+        sr_latch();
+        esp_rom_delay_us(INPUT_SETTLE_US);
+        sr_load();
+        sr_transfer(sr_tx[c + 1]);
+        for(uint32_t rows = sr_rows(); rows; rows &= rows - 1){
+            state[__builtin_ctz(rows)] |= (matrix_row_t)1 << c;
+        }
+    }
+    // the last transfer shifted in the all-high pattern
+    sr_latch();
+}
+
+int64_t matrix_backend_wait_for_key(){
+    // drive all columns once, then every poll is a single load and transfer of the rows
+    sr_transfer(sr_tx_idle);
+    sr_latch();
+    esp_rom_delay_us(INPUT_SETTLE_US);
+    for(;;){
+        sr_load();
+        sr_transfer(NULL);
+        if(sr_rows()){
+            break;
+        }
+#if NEXPANDER
+        if(expander_pending()){
+            break;
+        }
+#endif
+        vTaskDelay(pdMS_TO_TICKS(INPUT_IDLE_POLL_MS));
+    }
+    int64_t time = esp_timer_get_time();
+    sr_transfer(sr_tx[NCOL]);
+    sr_latch();
+    return time;
+}
+#else
+void matrix_backend_read(matrix_row_t state[NROW]){
+    sr_load();
+    sr_transfer(NULL);
+    // inputs are pulled up, a pressed key reads 0
+    for(int r = 0; r < NROW_BACKEND; r++){
+        matrix_row_t row = 0;
+        for(int i = 0; i < NCOL / 8; i++){
+            row |= (matrix_row_t)sr_rx[r * NCOL / 8 + i] << (8 * i);
+        }
+        state[r] = ~row & SR_ROW_MASK;
+    }
+}
+
+int64_t matrix_backend_wait_for_key(){
+    // no interrupt line, poll the whole matrix: it is a single transfer anyway
+    matrix_row_t state[NROW];
+    for(;;){
+        matrix_backend_read(state);
+        for(int r = 0; r < NROW_BACKEND; r++){
+            if(state[r]){
+                return esp_timer_get_time();
+            }
+        }
+#if NEXPANDER
+        if(expander_pending()){
+            return esp_timer_get_time();
+        }
+#endif
+        vTaskDelay(pdMS_TO_TICKS(INPUT_IDLE_POLL_MS));
+    }
+}
+#endif
+
+#endif
@@ -0,0 +1,73 @@
+#include <string.h>
+#include <stdlib.h>
+#include "esp_timer.h"
+
+#include "scan_timer.h"
+
+static esp_timer_handle_t timer;
+static TaskHandle_t scan_task = NULL;
+static uint32_t period = 0;
+static int64_t last_fire = 0;
+static uint32_t jitter_bins[SCAN_JITTER_BINS];
+static uint32_t jitter_max = 0;
+
+/** @brief Timer alarm, only wakes the scan task so it stays short. */
+static void IRAM_ATTR scan_timer_callback(void *arg){
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+    BaseType_t woken = pdFALSE;
+    vTaskNotifyGiveFromISR(scan_task, &woken);
+    if(woken){
+        // esp_timer yields once its dispatch is done, a callback must not do it itself
+        esp_timer_isr_dispatch_need_yield();
+    }
+#else
+    xTaskNotifyGive(scan_task);
+#endif
+}
+
+void scan_timer_init(){
+    scan_task = xTaskGetCurrentTaskHandle();
+    const esp_timer_create_args_t args = {
+        .callback = &scan_timer_callback,
+#if CONFIG_ESP_TIMER_SUPPORTS_ISR_DISPATCH_METHOD
+        // run the callback from the timer interrupt, not the esp_timer task
+        .dispatch_method = ESP_TIMER_ISR,
+#endif
+        .name = "scan"};
+    ESP_ERROR_CHECK(esp_timer_create(&args, &timer));
+}
+
+void scan_timer_start(uint32_t period_us){
+    period = period_us;
+    last_fire = 0;
+    ESP_ERROR_CHECK(esp_timer_start_periodic(timer, period_us));
+}
+
+void scan_timer_stop(){
+    ESP_ERROR_CHECK(esp_timer_stop(timer));
+}
+
+void scan_timer_wait(){
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    // measured when the task runs, so interrupt and scheduling latency count as jitter too
+    int64_t now = esp_timer_get_time();
+    if(last_fire != 0){
+        uint32_t deviation = abs((int32_t)(now - last_fire - period));
+        int bin = deviation ? 32 - __builtin_clz(deviation) : 0;
+        jitter_bins[bin < SCAN_JITTER_BINS ? bin : SCAN_JITTER_BINS - 1]++;
+        if(deviation > jitter_max){
+            jitter_max = deviation;
+        }
+    }
+    last_fire = now;
+}
+
+void scan_timer_jitter(uint32_t bins[SCAN_JITTER_BINS], uint32_t *max_us){
+    memcpy(bins, jitter_bins, sizeof(jitter_bins));
+    *max_us = jitter_max;
+}
+
+void scan_timer_reset_jitter(){
+    memset(jitter_bins, 0, sizeof(jitter_bins));
+    jitter_max = 0;
+}
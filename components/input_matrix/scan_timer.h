@@ -0,0 +1,25 @@
+#ifndef _SCAN_TIMER_H_
+#define _SCAN_TIMER_H_
+
+#include <stdint.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+
+/** @brief Number of jitter histogram bins, bin n counts periods that were off by [2^(n-1), 2^n) microseconds. */
+#define SCAN_JITTER_BINS 12
+
+/** @brief Create the periodic scan timer, it wakes the calling task. */
+void scan_timer_init();
+
+/** @brief Start waking the scan task every period_us microseconds. */
+void scan_timer_start(uint32_t period_us);
+void scan_timer_stop();
+
+/** @brief Block until the next timer period, records the period jitter. */
+void scan_timer_wait();
+
+/** @brief Copy the jitter histogram, and the largest deviation seen in microseconds. */
+void scan_timer_jitter(uint32_t bins[SCAN_JITTER_BINS], uint32_t *max_us);
+void scan_timer_reset_jitter();
+
+#endif
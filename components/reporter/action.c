@@ -0,0 +1,106 @@
+#include <string.h>
+
+#include "action.h"
+#include "host.h"
+#include "layer.h"
+#include "macro.h"
+
+typedef void (*action_handler_t)(action_state_t *state, action_t action, bool pressed);
+
+void action_init(action_state_t *state)
+{
+    memset(state, 0, sizeof(*state));
+    report_init(&state->keyboard);
+}
+
+static void action_key(action_state_t *state, action_t action, bool pressed)
+{
+    state->keyboard_changed |= report_apply(&state->keyboard, action & 0xff, pressed);
+}
+
+/** @brief Press the modifiers before the key and release them after it.
+ *
+ * The modifiers go through the report builder like modifier keys, so a modifier
+ * that is held on its own key stays pressed. */
+static void action_mods(action_state_t *state, action_t action, bool pressed, uint8_t first_modifier)
+{
+    if (!pressed)
+    {
+        action_key(state, action, false);
+    }
+    for (uint8_t mods = (action >> 8) & 0xf; mods; mods &= mods - 1)
+    {
+        state->keyboard_changed |= report_apply(&state->keyboard, first_modifier + __builtin_ctz(mods), pressed);
+    }
+    if (pressed)
+    {
+        action_key(state, action, true);
+    }
+}
+
+static void action_lmods(action_state_t *state, action_t action, bool pressed)
+{
+    action_mods(state, action, pressed, KC_LCTRL);
+}
+
+static void action_rmods(action_state_t *state, action_t action, bool pressed)
+{
+    action_mods(state, action, pressed, KC_RCTRL);
+}
+
+static void action_consumer(action_state_t *state, action_t action, bool pressed)
+{
+    // the consumer report holds a single usage, a release only clears the usage it pressed
+    uint8_t usage = action & 0xff;
+    if (pressed)
+    {
+        state->consumer = usage;
+        state->consumer_changed = true;
+    }
+    else if (state->consumer == usage)
+    {
+        state->consumer = 0;
+        state->consumer_changed = true;
+    }
+}
+
+static void action_layer(action_state_t *state, action_t action, bool pressed)
+{
+    layer_action(action, pressed);
+}
+
+static void action_macro(action_state_t *state, action_t action, bool pressed)
+{
+    if (pressed)
+    {
+        macro_start(action & 0xfff);
+    }
+}
+
+static void action_host(action_state_t *state, action_t action, bool pressed)
+{
+    if (pressed)
+    {
+        host_select(action & 0xff, ((action >> 8) & 0xf) == HOST_OP_PAIR);
+    }
+}
+
+static const action_handler_t action_handlers[ACTION_KINDS] = {
+    [ACTION_KEY] = action_key,
+    [ACTION_LMODS] = action_lmods,
+    [ACTION_RMODS] = action_rmods,
+    [ACTION_CONSUMER] = action_consumer,
+    [ACTION_LAYER] = action_layer,
+    [ACTION_MACRO] = action_macro,
+    [ACTION_HOST] = action_host,
+};
+
+void action_apply(action_state_t *state, action_t action, bool pressed)
+{
+    // kinds without a handler do nothing, e.g. the tap-hold kinds tap_hold.c resolves first
+    action_handler_t handler = action_handlers[ACTION_KIND(action)];
+    if (handler != NULL)
+    {
+        handler(state, action, pressed);
+    }
+}
@@ -0,0 +1,69 @@
+#ifndef _ACTION_H_
+#define _ACTION_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "report_builder.h"
+
+/** @brief Keymap entry, the kind in the top 4 bits and its argument in the low 12.
+ *
+ * Plain HID keycodes (KC_*) are ACTION_KEY actions as they are, so they can be used
+ * in a keymap directly. */
+typedef uint16_t action_t;
+
+#define ACTION_KIND(action) ((action) >> 12)
+#define ACTION(kind, arg) ((action_t)((kind) << 12 | (arg)))
+
+/** @brief Action kinds, every kind has a handler in action.c. */
+enum action_kind
+{
+    ACTION_KEY,      // HID keycode in bits 0-7
+    ACTION_LMODS,    // HID keycode in bits 0-7, pressed with the left modifiers in bits 8-11
+    ACTION_RMODS,    // same with the right modifiers
+    ACTION_CONSUMER, // consumer usage (consumer_cmd_t, hid_dev.h) in bits 0-7
+    ACTION_LAYER,    // layer operation in bits 8-11, layer in bits 0-7, see layer.h
+    ACTION_LMOD_TAP, // HID keycode in bits 0-7 on tap, the left modifiers in bits 8-11 on hold, see tap_hold.h
+    ACTION_RMOD_TAP, // same with the right modifiers
+    ACTION_LAYER_TAP, // HID keycode in bits 0-7 on tap, momentary layer 0-15 in bits 8-11 on hold
+    ACTION_MACRO,     // macro index in bits 0-11, see macro.h
+    ACTION_HOST,      // host profile in bits 0-7, operation in bits 8-11, see host.h
+    ACTION_KINDS = 16,
+};
+
+/** @brief Use the action of the next lower active layer.
+ *
+ * 0x01 is the ErrorRollOver usage, which is never sent from a keymap. */
+#define KC_TRANSPARENT 0x0001
+
+/** @brief Modifier bits of ACTION_LMODS/ACTION_RMODS, in KeyboardModifier order. */
+#define MOD_CTRL 0x1
+#define MOD_SHIFT 0x2
+#define MOD_ALT 0x4
+#define MOD_GUI 0x8
+/** @brief Key with modifiers, e.g. LMODS(MOD_SHIFT, KC_1) for '!'. */
+#define LMODS(mods, keycode) ACTION(ACTION_LMODS, (mods) << 8 | (keycode))
+#define RMODS(mods, keycode) ACTION(ACTION_RMODS, (mods) << 8 | (keycode))
+#define LSFT(keycode) LMODS(MOD_SHIFT, keycode)
+#define LCTL(keycode) LMODS(MOD_CTRL, keycode)
+#define RALT(keycode) RMODS(MOD_ALT, keycode)
+/** @brief Consumer control key, e.g. CONSUMER(HID_CONSUMER_VOLUME_UP). */
+#define CONSUMER(usage) ACTION(ACTION_CONSUMER, usage)
+
+/** @brief State the actions work on, the reporter sends whatever changed. */
+typedef struct
+{
+    keyboard_report_t keyboard;
+    uint8_t keyboard_changed; // REPORT_CHANGED_* bits since the reporter last cleared them
+    uint8_t consumer;         // usage of the held consumer key, 0 if none
+    bool consumer_changed;
+} action_state_t;
+
+void action_init(action_state_t *state);
+
+/** @brief Apply the press or release of an action.
+ *
+ * The kind selects the handler through a table, adding a kind does not add a branch here. */
+void action_apply(action_state_t *state, action_t action, bool pressed);
+
+#endif
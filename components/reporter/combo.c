@@ -0,0 +1,272 @@
+#include <string.h>
+#include "esp_log.h"
+
+#include "combo.h"
+
+#define COMBO_TAG "combo"
+
+/** @brief One bit per matrix key, a single word for matrices of up to 64 keys. */
+#define COMBO_WORDS ((NBUTTON + 63) / 64)
+typedef struct
+{
+    uint64_t bits[COMBO_WORDS];
+} combo_mask_t;
+
+static const combo_t *combo_table;
+static int combo_count;
+static combo_emit_t combo_emit;
+
+static combo_mask_t combo_masks[COMBO_MAX];
+// combos of key k are combo_index[combo_first[k]] up to combo_index[combo_first[k + 1] - 1]
+static uint16_t combo_first[NBUTTON + 1];
+static uint16_t combo_index[COMBO_MAX * COMBO_MAX_KEYS];
+
+// held back presses, in order, and their mask
+static key_event_t pending[COMBO_MAX_KEYS];
+static int npending;
+static combo_mask_t pending_mask;
+static int pending_complete = -1;  // combo the held back keys complete, while waiting for a longer one
+static int64_t pending_deadline;
+// combo each key is part of while the combo is pressed, index + 1
+static uint16_t combo_owner[NBUTTON];
+static uint8_t combo_held[COMBO_MAX];  // member keys of each pressed combo that are still down
+
+static inline bool mask_contains(const combo_mask_t *mask, const combo_mask_t *subset)
+{
+    for (int i = 0; i < COMBO_WORDS; i++)
+    {
+        if ((mask->bits[i] & subset->bits[i]) != subset->bits[i])
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static inline bool mask_equal(const combo_mask_t *a, const combo_mask_t *b)
+{
+    return memcmp(a, b, sizeof(*a)) == 0;
+}
+
+static inline void mask_set(combo_mask_t *mask, uint8_t key)
+{
+    mask->bits[key / 64] |= 1ULL << (key % 64);
+}
+
+static int64_t combo_term_us(int combo)
+{
+    return (combo_table[combo].term_ms ? combo_table[combo].term_ms : COMBO_TERM_MS) * 1000LL;
+}
+
+void combo_init(const combo_t *combos, int ncombos, combo_emit_t emit)
+{
+    if (ncombos > COMBO_MAX)
+    {
+        ESP_LOGE(COMBO_TAG, "%d combos, only the first %d are used", ncombos, COMBO_MAX);
+        ncombos = COMBO_MAX;
+    }
+    combo_table = combos;
+    combo_count = ncombos;
+    combo_emit = emit;
+    npending = 0;
+    pending_complete = -1;
+    memset(&pending_mask, 0, sizeof(pending_mask));
+    memset(combo_owner, 0, sizeof(combo_owner));
+
+    // counting sort of the combos by member key
+    uint16_t count[NBUTTON] = {0};
+    memset(combo_masks, 0, sizeof(combo_masks));
+    for (int c = 0; c < ncombos; c++)
+    {
+        for (int i = 0; i < combos[c].nkeys; i++)
+        {
+            mask_set(&combo_masks[c], combos[c].keys[i]);
+            count[combos[c].keys[i]]++;
+        }
+    }
+    combo_first[0] = 0;
+    for (int k = 0; k < NBUTTON; k++)
+    {
+        combo_first[k + 1] = combo_first[k] + count[k];
+        count[k] = combo_first[k];
+    }
+    for (int c = 0; c < ncombos; c++)
+    {
+        for (int i = 0; i < combos[c].nkeys; i++)
+        {
+            combo_index[count[combos[c].keys[i]]++] = c;
+        }
+    }
+}
+
+/** @brief Pass the held back presses on as they are. */
+static void combo_flush()
+{
+    for (int i = 0; i < npending; i++)
+    {
+        combo_emit(&pending[i], KC_NO);
+    }
+    npending = 0;
+    pending_complete = -1;
+    memset(&pending_mask, 0, sizeof(pending_mask));
+}
+
+static void combo_fire(int combo, int64_t time)
+{
+    const combo_t *c = &combo_table[combo];
+    for (int i = 0; i < c->nkeys; i++)
+    {
+        combo_owner[c->keys[i]] = combo + 1;
+    }
+    combo_held[combo] = c->nkeys;
+    key_event_t event = {.time = time, .key = c->keys[0], .pressed = true};
+    combo_emit(&event, c->action);
+    npending = 0;
+    pending_complete = -1;
+    memset(&pending_mask, 0, sizeof(pending_mask));
+}
+
+/** @brief Fire the combo the held back keys complete, or pass them on. */
+static void combo_resolve(int64_t time)
+{
+    if (pending_complete >= 0)
+    {
+        combo_fire(pending_complete, time);
+    }
+    else
+    {
+        combo_flush();
+    }
+}
+
+/** @brief Look through the combos of key for the ones that still match mask at time.
+ *
+ * @return index of the combo that mask completes, -1 if none, and in *open whether a combo
+ * with more keys could still complete */
+static int combo_match(uint8_t key, const combo_mask_t *mask, int64_t first, int64_t time, bool *open)
+{
+    int complete = -1;
+    *open = false;
+    for (int i = combo_first[key]; i < combo_first[key + 1]; i++)
+    {
+        int c = combo_index[i];
+        if (!mask_contains(&combo_masks[c], mask) || time - first > combo_term_us(c))
+        {
+            continue;
+        }
+        if (mask_equal(&combo_masks[c], mask))
+        {
+            complete = c;
+        }
+        else
+        {
+            *open = true;
+        }
+    }
+    return complete;
+}
+
+/** @brief Latest time one of the open combos of key can still complete at. */
+static int64_t combo_deadline(uint8_t key)
+{
+    int64_t deadline = 0;
+    for (int i = combo_first[key]; i < combo_first[key + 1]; i++)
+    {
+        int c = combo_index[i];
+        if (mask_contains(&combo_masks[c], &pending_mask) && !mask_equal(&combo_masks[c], &pending_mask) &&
+            pending[0].time + combo_term_us(c) > deadline)
+        {
+            deadline = pending[0].time + combo_term_us(c);
+        }
+    }
+    return deadline;
+}
+
+static void combo_press(const key_event_t *event)
+{
+    if (combo_first[event->key] == combo_first[event->key + 1])
+    {
+        // not part of any combo, no latency unless combo keys are held back
+        if (npending)
+        {
+            combo_resolve(event->time);
+        }
+        combo_emit(event, KC_NO);
+        return;
+    }
+
+    combo_mask_t mask = pending_mask;
+    mask_set(&mask, event->key);
+    int64_t first = npending ? pending[0].time : event->time;
+    bool open;
+    int complete = combo_match(event->key, &mask, first, event->time, &open);
+    if (complete < 0 && !open)
+    {
+        if (npending == 0)
+        {
+            // every combo of the key has a term of 0
+            combo_emit(event, KC_NO);
+            return;
+        }
+        // the key doesn't fit the held back keys, maybe it starts a combo of its own
+        combo_resolve(event->time);
+        combo_press(event);
+        return;
+    }
+    pending[npending++] = *event;
+    pending_mask = mask;
+    pending_complete = complete;
+    if (!open)
+    {
+        combo_fire(complete, event->time);
+    }
+    else
+    {
+        // wait for more keys, a combo with fewer keys fires when they don't come
+        pending_deadline = combo_deadline(event->key);
+    }
+}
+
+void combo_event(const key_event_t *event)
+{
+    if (event->pressed)
+    {
+        combo_press(event);
+        return;
+    }
+
+    if (npending)
+    {
+        // a held back key is released before more keys came, or another key is released
+        // and has to reach the host after the held back presses, e.g. a Shift for a combo key
+        combo_resolve(event->time);
+    }
+    uint16_t owner = combo_owner[event->key];
+    if (owner == 0)
+    {
+        combo_emit(event, KC_NO);
+        return;
+    }
+    // the first released key releases the combo, the releases of the other keys are dropped
+    const combo_t *c = &combo_table[owner - 1];
+    combo_owner[event->key] = 0;
+    if (combo_held[owner - 1]-- == c->nkeys)
+    {
+        key_event_t release = {.time = event->time, .key = c->keys[0], .pressed = false};
+        combo_emit(&release, c->action);
+    }
+}
+
+int64_t combo_tick(int64_t now)
+{
+    if (npending == 0)
+    {
+        return INT64_MAX;
+    }
+    if (now < pending_deadline)
+    {
+        return pending_deadline;
+    }
+    combo_resolve(pending_deadline);
+    return INT64_MAX;
+}
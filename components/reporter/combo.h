@@ -0,0 +1,45 @@
+#ifndef _COMBO_H_
+#define _COMBO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "input_matrix.h"
+#include "key_event.h"
+#include "action.h"
+
+/** @brief Maximum number of keys in a combo. */
+#define COMBO_MAX_KEYS 3
+/** @brief Maximum number of combos in a table. */
+#define COMBO_MAX 512
+/** @brief Time in milliseconds from the first to the last key of a combo, unless the combo sets its own. */
+#define COMBO_TERM_MS 50
+
+/** @brief Keys pressed together that emit a different action, e.g.
+ * {2, {MATRIX_KEY(2, 1), MATRIX_KEY(2, 2)}, KC_ESCAPE}. */
+typedef struct
+{
+    uint8_t nkeys;                 // 2 to COMBO_MAX_KEYS
+    uint8_t keys[COMBO_MAX_KEYS];  // matrix key indices, see MATRIX_KEY()
+    action_t action;
+    uint16_t term_ms;              // 0 for COMBO_TERM_MS
+} combo_t;
+
+/** @brief Receives the key events that are not part of a combo, action is KC_NO for them,
+ * and the presses and releases of combos with their action. */
+typedef void (*combo_emit_t)(const key_event_t *event, action_t action);
+
+/** @brief Build the per key index and the key masks of the combos. */
+void combo_init(const combo_t *combos, int ncombos, combo_emit_t emit);
+
+/** @brief Hold back presses of combo keys until they either complete a combo or can't any more.
+ *
+ * Keys that belong to no combo pass straight through. */
+void combo_event(const key_event_t *event);
+
+/** @brief Give up on the held back keys once the term of every combo they could still complete ran out.
+ *
+ * @return esp_timer time to call again at, INT64_MAX if no key is held back */
+int64_t combo_tick(int64_t now);
+
+#endif
@@ -7,7 +7,7 @@
 
 typedef struct config_data {
     char bt_device_name[MAX_BT_DEVICENAME_LENGTH];
-    uint8_t locale;
+    uint8_t locale; // host keyboard layout, layout_id_t (layout.h)
 } config_data_t;
 
 
@@ -0,0 +1,230 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "esp_gap_ble_api.h"
+
+#include "conn_params.h"
+
+#define CONN_PARAMS_TAG "conn_params"
+
+/** @brief Intervals to ask for while typing, min and max in 1.25ms units, the next pair once a host rejected one.
+ *
+ * 7.5ms first, then what stricter hosts accept, e.g. 11.25ms for HID devices on iOS. */
+static const uint16_t active_intervals[][2] = {{6, 6}, {6, 12}, {9, 12}, {12, 24}};
+#define ACTIVE_STEPS (sizeof(active_intervals) / sizeof(active_intervals[0]))
+
+static const char *const mode_names[CONN_MODES] = {"active", "idle", "host"};
+
+// events of the Bluetooth task, handed over to conn_params_tick() under the lock
+#define EVENT_CONNECTED 0x1
+#define EVENT_DISCONNECTED 0x2
+#define EVENT_UPDATED 0x4
+static portMUX_TYPE event_lock = portMUX_INITIALIZER_UNLOCKED;
+static uint32_t events;
+static esp_bd_addr_t event_bda;
+static bool event_success;
+static uint16_t event_interval, event_latency, event_timeout;
+
+// state of the report task
+static bool connected;
+static esp_bd_addr_t peer;
+static int64_t last_activity;
+static conn_mode_t target = CONN_MODE_OTHER;  // mode of the last request
+static bool pending;                          // request sent, no result yet
+static bool retry;                            // the last request was rejected, ask again at retry_at
+static int64_t retry_at;
+static uint8_t active_step;                   // entry of active_intervals to ask for
+static uint8_t rejects[CONN_MODE_OTHER];
+static conn_mode_t mode = CONN_MODE_OTHER;    // mode of the parameters in use
+static int64_t mode_since;
+static int64_t mode_time[CONN_MODES];
+
+void conn_params_connected(const esp_bd_addr_t bda)
+{
+    portENTER_CRITICAL(&event_lock);
+    memcpy(event_bda, bda, sizeof(esp_bd_addr_t));
+    events = (events & ~EVENT_UPDATED) | EVENT_CONNECTED;
+    portEXIT_CRITICAL(&event_lock);
+}
+
+void conn_params_disconnected()
+{
+    portENTER_CRITICAL(&event_lock);
+    events = (events & ~(EVENT_CONNECTED | EVENT_UPDATED)) | EVENT_DISCONNECTED;
+    portEXIT_CRITICAL(&event_lock);
+}
+
+void conn_params_updated(bool success, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+    portENTER_CRITICAL(&event_lock);
+    event_success = success;
+    event_interval = interval;
+    event_latency = latency;
+    event_timeout = timeout;
+    events |= EVENT_UPDATED;
+    portEXIT_CRITICAL(&event_lock);
+}
+
+void conn_params_activity(int64_t now)
+{
+    last_activity = now;
+}
+
+static void account(int64_t now)
+{
+    mode_time[mode] += now - mode_since;
+    mode_since = now;
+}
+
+void conn_params_stats(int64_t now, int64_t time_us[CONN_MODES])
+{
+    for (int i = 0; i < CONN_MODES; i++)
+    {
+        time_us[i] = mode_time[i];
+    }
+    if (connected)
+    {
+        time_us[mode] += now - mode_since;
+    }
+}
+
+static conn_mode_t classify(uint16_t interval, uint16_t latency)
+{
+    if (latency == 0 && interval <= active_intervals[active_step][1])
+    {
+        return CONN_MODE_ACTIVE;
+    }
+    if (interval >= CONN_PARAMS_IDLE_MIN_INT && interval <= CONN_PARAMS_IDLE_MAX_INT)
+    {
+        return CONN_MODE_IDLE;
+    }
+    return CONN_MODE_OTHER;
+}
+
+static void reject(int64_t now)
+{
+    rejects[target]++;
+    if (target == CONN_MODE_ACTIVE && active_step + 1 < ACTIVE_STEPS)
+    {
+        active_step++;
+    }
+    retry = true;
+    retry_at = now + CONN_PARAMS_RETRY_MS * 1000LL;
+    if (rejects[target] == CONN_PARAMS_MAX_REJECTS)
+    {
+        ESP_LOGW(CONN_PARAMS_TAG, "host rejected %s parameters %d times, keeping its own", mode_names[target], rejects[target]);
+    }
+}
+
+static void request(conn_mode_t wanted, int64_t now)
+{
+    esp_ble_conn_update_params_t params;
+    memcpy(params.bda, peer, sizeof(esp_bd_addr_t));
+    if (wanted == CONN_MODE_ACTIVE)
+    {
+        params.min_int = active_intervals[active_step][0];
+        params.max_int = active_intervals[active_step][1];
+        params.latency = 0;
+        params.timeout = CONN_PARAMS_ACTIVE_TIMEOUT;
+    }
+    else
+    {
+        params.min_int = CONN_PARAMS_IDLE_MIN_INT;
+        params.max_int = CONN_PARAMS_IDLE_MAX_INT;
+        params.latency = CONN_PARAMS_IDLE_LATENCY;
+        params.timeout = CONN_PARAMS_IDLE_TIMEOUT;
+    }
+    ESP_LOGD(CONN_PARAMS_TAG, "requesting %s, interval %d-%d, latency %d",
+             mode_names[wanted], params.min_int, params.max_int, params.latency);
+    target = wanted;
+    retry = false;
+    if (esp_ble_gap_update_conn_params(&params) == ESP_OK)
+    {
+        pending = true;
+    }
+    else
+    {
+        reject(now);
+    }
+}
+
+static void updated(int64_t now, bool success, uint16_t interval, uint16_t latency, uint16_t timeout)
+{
+    bool requested = pending;
+    pending = false;
+    if (!success)
+    {
+        if (requested)
+        {
+            ESP_LOGI(CONN_PARAMS_TAG, "host rejected %s parameters", mode_names[target]);
+            reject(now);
+        }
+        return;
+    }
+    account(now);
+    mode = classify(interval, latency);
+    // a host that renegotiates on its own keeps its parameters until the activity changes the mode we want
+    ESP_LOGI(CONN_PARAMS_TAG, "%s parameters (%s): interval %d.%02dms, latency %d, timeout %dms",
+             mode_names[mode], requested ? "requested" : "by host",
+             interval * 125 / 100, interval * 125 % 100, latency, timeout * 10);
+}
+
+int64_t conn_params_tick(int64_t now)
+{
+    portENTER_CRITICAL(&event_lock);
+    uint32_t e = events;
+    events = 0;
+    esp_bd_addr_t bda;
+    memcpy(bda, event_bda, sizeof(esp_bd_addr_t));
+    bool success = event_success;
+    uint16_t interval = event_interval, latency = event_latency, timeout = event_timeout;
+    portEXIT_CRITICAL(&event_lock);
+
+    if ((e & EVENT_DISCONNECTED) && connected)
+    {
+        account(now);
+        ESP_LOGI(CONN_PARAMS_TAG, "connection spent %llds active, %llds idle, %llds with host parameters",
+                 mode_time[CONN_MODE_ACTIVE] / 1000000, mode_time[CONN_MODE_IDLE] / 1000000,
+                 mode_time[CONN_MODE_OTHER] / 1000000);
+        connected = false;
+    }
+    if (e & EVENT_CONNECTED)
+    {
+        connected = true;
+        memcpy(peer, bda, sizeof(esp_bd_addr_t));
+        last_activity = now;
+        target = CONN_MODE_OTHER;
+        pending = false;
+        retry = false;
+        active_step = 0;
+        memset(rejects, 0, sizeof(rejects));
+        mode = CONN_MODE_OTHER;
+        mode_since = now;
+        memset(mode_time, 0, sizeof(mode_time));
+    }
+    if ((e & EVENT_UPDATED) && connected)
+    {
+        updated(now, success, interval, latency, timeout);
+    }
+    if (!connected)
+    {
+        return INT64_MAX;
+    }
+
+    conn_mode_t wanted = now - last_activity < CONN_PARAMS_IDLE_MS * 1000LL ? CONN_MODE_ACTIVE : CONN_MODE_IDLE;
+    bool allowed = rejects[wanted] < CONN_PARAMS_MAX_REJECTS;
+    if (!pending && allowed && (wanted != target || (retry && now >= retry_at)))
+    {
+        request(wanted, now);
+    }
+    int64_t deadline = INT64_MAX;
+    if (wanted == CONN_MODE_ACTIVE)
+    {
+        deadline = last_activity + CONN_PARAMS_IDLE_MS * 1000LL;
+    }
+    if (!pending && allowed && retry && retry_at < deadline)
+    {
+        deadline = retry_at;
+    }
+    return deadline;
+}
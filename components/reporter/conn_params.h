@@ -0,0 +1,58 @@
+#ifndef _CONN_PARAMS_H_
+#define _CONN_PARAMS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_bt_defs.h"
+
+/** @brief Time in milliseconds without a key event before the connection is relaxed. */
+#define CONN_PARAMS_IDLE_MS 5000
+/** @brief Time in milliseconds before asking again after a host rejected the parameters. */
+#define CONN_PARAMS_RETRY_MS 2000
+/** @brief Rejections of a mode after which it is not requested again on this connection. */
+#define CONN_PARAMS_MAX_REJECTS 4
+
+/** @brief Relaxed connection while idle, intervals in 1.25ms units, timeout in 10ms units.
+ *
+ * Within the limits of the Apple accessory guidelines: interval * (latency + 1) <= 2s,
+ * min + 15ms <= max and a timeout of at most 6s. */
+#define CONN_PARAMS_IDLE_MIN_INT 48   // 60ms
+#define CONN_PARAMS_IDLE_MAX_INT 80   // 100ms
+#define CONN_PARAMS_IDLE_LATENCY 10
+#define CONN_PARAMS_IDLE_TIMEOUT 600  // 6s
+/** @brief Supervision timeout while typing, the interval is the shortest the host accepts with latency 0. */
+#define CONN_PARAMS_ACTIVE_TIMEOUT 400 // 4s
+
+/** @brief Connection modes, and the bins of the time spent in them. */
+typedef enum
+{
+    CONN_MODE_ACTIVE,   // short interval, no slave latency
+    CONN_MODE_IDLE,     // long interval, high slave latency
+    CONN_MODE_OTHER,    // parameters the host chose
+    CONN_MODES,
+} conn_mode_t;
+
+/** @brief The link is encrypted, start managing its parameters. Called from the Bluetooth task. */
+void conn_params_connected(const esp_bd_addr_t bda);
+
+/** @brief The link is gone. Called from the Bluetooth task. */
+void conn_params_disconnected();
+
+/** @brief Result of ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT, of our request or one of the host.
+ *
+ * Called from the Bluetooth task, the report task picks it up in conn_params_tick(). */
+void conn_params_updated(bool success, uint16_t interval, uint16_t latency, uint16_t timeout);
+
+/** @brief Keys were pressed or released at esp_timer time now. */
+void conn_params_activity(int64_t now);
+
+/** @brief Handle the events of the Bluetooth task, request the mode the activity asks for.
+ *
+ * @return esp_timer time to call again at, INT64_MAX if nothing is due */
+int64_t conn_params_tick(int64_t now);
+
+/** @brief Microseconds the current connection spent in each mode so far. */
+void conn_params_stats(int64_t now, int64_t time_us[CONN_MODES]);
+
+#endif
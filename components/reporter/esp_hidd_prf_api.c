@@ -19,9 +19,6 @@
 #include <string.h>
 #include "esp_log.h"
 
-// HID keyboard input report length
-#define HID_KEYBOARD_IN_RPT_LEN     8
-
 // HID LED output report length
 #define HID_LED_OUT_RPT_LEN         1
 
@@ -98,24 +95,20 @@ uint16_t esp_hidd_get_version(void)
 	return HIDD_VERSION;
 }
 
-void esp_hidd_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed)
+bool esp_hidd_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed)
 {
     uint8_t buffer[HID_CC_IN_RPT_LEN] = {0, 0};
     if (key_pressed) {
-        ESP_LOGD(HID_LE_PRF_TAG, "hid_consumer_build_report");
         hid_consumer_build_report(buffer, key_cmd);
     }
-    ESP_LOGD(HID_LE_PRF_TAG, "buffer[0] = %x, buffer[1] = %x", buffer[0], buffer[1]);
-    hid_dev_send_report(hidd_le_env.gatt_if, conn_id,
-                        HID_RPT_ID_CC_IN, HID_REPORT_TYPE_INPUT, HID_CC_IN_RPT_LEN, buffer);
-    return;
+    return hid_dev_send_report(hidd_le_env.gatt_if, conn_id, HID_RPT_KIND_CC_IN, HID_CC_IN_RPT_LEN, buffer);
 }
 
-void esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key)
+bool esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key)
 {
     if (num_key > HID_KEYBOARD_IN_RPT_LEN - 2) {
         ESP_LOGE(HID_LE_PRF_TAG, "%s(), the number key should not be more than %d", __func__, HID_KEYBOARD_IN_RPT_LEN);
-        return;
+        return true;
     }
    
     uint8_t buffer[HID_KEYBOARD_IN_RPT_LEN] = {0};
@@ -126,13 +119,54 @@ void esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask,
         buffer[i+2] = keyboard_cmd[i];
     }
 
-    ESP_LOGD(HID_LE_PRF_TAG, "the key vaule = %d,%d,%d, %d, %d, %d,%d, %d", buffer[0], buffer[1], buffer[2], buffer[3], buffer[4], buffer[5], buffer[6], buffer[7]);
-    hid_dev_send_report(hidd_le_env.gatt_if, conn_id,
-                        HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT, HID_KEYBOARD_IN_RPT_LEN, buffer);
-    return;
+    return hid_dev_send_report(hidd_le_env.gatt_if, conn_id, HID_RPT_KIND_KEY_IN, HID_KEYBOARD_IN_RPT_LEN, buffer);
+}
+
+bool esp_hidd_send_keyboard_report(uint16_t conn_id, const uint8_t report[HID_KEYBOARD_IN_RPT_LEN])
+{
+    return hid_dev_send_report(hidd_le_env.gatt_if, conn_id, HID_RPT_KIND_KEY_IN, HID_KEYBOARD_IN_RPT_LEN, report);
+}
+
+bool esp_hidd_nkro_available(uint16_t conn_id)
+{
+    hidd_clcb_t *p_clcb = hidd_clcb_acquire(conn_id);
+    if (p_clcb == NULL) {
+        return false;
+    }
+    // notifications carry at most MTU - 3 bytes of the value
+    bool available = hidProtocolMode == HID_PROTOCOL_MODE_REPORT && p_clcb->mtu >= HID_NKRO_IN_RPT_LEN + 3;
+    hidd_clcb_release(p_clcb);
+    return available;
+}
+
+bool esp_hidd_send_nkro_value(uint16_t conn_id, const uint8_t bitmap[HID_NKRO_IN_RPT_LEN])
+{
+    return hid_dev_send_report(hidd_le_env.gatt_if, conn_id, HID_RPT_KIND_NKRO_IN, HID_NKRO_IN_RPT_LEN, bitmap);
+}
+
+void esp_hidd_flush(uint16_t conn_id)
+{
+    hid_dev_flush(hidd_le_env.gatt_if, conn_id);
+}
+
+bool esp_hidd_send_ready(uint16_t conn_id)
+{
+    return hid_dev_send_ready(conn_id);
+}
+
+void esp_hidd_get_queue_stats(uint16_t conn_id, esp_hidd_queue_stats_t *stats)
+{
+    hidd_clcb_t *p_clcb = hidd_clcb_acquire(conn_id);
+
+    if (p_clcb != NULL) {
+        *stats = p_clcb->ntf_stats;
+        hidd_clcb_release(p_clcb);
+    } else {
+        memset(stats, 0, sizeof(*stats));
+    }
 }
 
-void esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys_x, int8_t mickeys_y, int8_t wheel)
+bool esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys_x, int8_t mickeys_y, int8_t wheel)
 {
     uint8_t buffer[HID_MOUSE_IN_RPT_LEN];
     
@@ -142,7 +176,5 @@ void esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mi
     buffer[3] = wheel;           // Wheel
     buffer[4] = 0;           // AC Pan
 
-    hid_dev_send_report(hidd_le_env.gatt_if, conn_id,
-                        HID_RPT_ID_MOUSE_IN, HID_REPORT_TYPE_INPUT, HID_MOUSE_IN_RPT_LEN, buffer);
-    return;
+    return hid_dev_send_report(hidd_le_env.gatt_if, conn_id, HID_RPT_KIND_MOUSE_IN, HID_MOUSE_IN_RPT_LEN, buffer);
 }
\ No newline at end of file
@@ -32,6 +32,8 @@ typedef enum {
     ESP_HIDD_EVENT_BLE_DISCONNECT,
     ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT,
     ESP_HIDD_EVENT_BLE_LED_OUT_WRITE_EVT,
+    ESP_HIDD_EVENT_BLE_CONF,
+    ESP_HIDD_EVENT_BLE_CONGEST,
 } esp_hidd_cb_event_t;
 
 /// HID config status
@@ -62,6 +64,24 @@ typedef enum {
 #define RIGHT_GUI_KEY_MASK           (1 << 7)
 
 typedef uint8_t key_mask_t;
+
+// HID keyboard input report length, modifier byte, reserved byte and six keycodes
+#define HID_KEYBOARD_IN_RPT_LEN     8
+
+// HID NKRO keyboard input report length, one bit per keycode from 0x04 to 0xE7
+#define HID_NKRO_IN_RPT_LEN         29
+
+// Notifications handed to the stack and not confirmed yet, so several go out per connection event
+#define HIDD_NTF_IN_FLIGHT          4
+
+/// Counters of the outbound report queue of a connection
+typedef struct {
+    uint32_t queued;      /*!< Reports given to the queue */
+    uint32_t coalesced;   /*!< Reports merged into a queued one without losing a press or release */
+    uint32_t refused;     /*!< Reports refused by a full queue, the caller sends its state again */
+    uint32_t sent;        /*!< Notifications handed to the stack */
+    uint32_t keyboard_wait_max_us; /*!< Longest time a keyboard report waited in the queue */
+} esp_hidd_queue_stats_t;
 /**
  * @brief HIDD callback parameters union 
  */
@@ -93,6 +113,7 @@ typedef union {
      * @brief ESP_HIDD_EVENT_DISCONNECT
 	 */
     struct hidd_disconnect_evt_param {
+        uint16_t conn_id;                           /*!< HID connection index */
         esp_bd_addr_t remote_bda;                   /*!< HID Remote bluetooth device address */
     } disconnect;									/*!< HID callback param of ESP_HIDD_EVENT_DISCONNECT */
 
@@ -106,6 +127,22 @@ typedef union {
         uint8_t  *data;                             /*!< The pointer to the data */
     } vendor_write;									/*!< HID callback param of ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT */
 
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_CONF, a notification left the stack's queue
+	 */
+    struct hidd_conf_evt_param {
+        uint16_t conn_id;                           /*!< HID connection index */
+        esp_gatt_status_t status;                   /*!< Status of the notification */
+    } conf;										    /*!< HID callback param of ESP_HIDD_EVENT_BLE_CONF */
+
+    /**
+     * @brief ESP_HIDD_EVENT_BLE_CONGEST
+	 */
+    struct hidd_congest_evt_param {
+        uint16_t conn_id;                           /*!< HID connection index */
+        bool congested;                             /*!< Further notifications are held back by the stack */
+    } congest;									    /*!< HID callback param of ESP_HIDD_EVENT_BLE_CONGEST */
+
 } esp_hidd_cb_param_t;
 
 
@@ -156,11 +193,85 @@ esp_err_t esp_hidd_profile_deinit(void);
  */
 uint16_t esp_hidd_get_version(void);
 
-void esp_hidd_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed);
+/**
+ *
+ * @brief           Send the consumer control report, the keyboard and NKRO send functions
+ *                  below return the same way
+ *
+ * @return          false if the queue of the report is full, nothing was sent: send the current
+ *                  state again after ESP_HIDD_EVENT_BLE_CONF, a queued release is never replaced
+ *
+ */
+bool esp_hidd_send_consumer_value(uint16_t conn_id, uint8_t key_cmd, bool key_pressed);
+
+bool esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key);
 
-void esp_hidd_send_keyboard_value(uint16_t conn_id, key_mask_t special_key_mask, uint8_t *keyboard_cmd, uint8_t num_key);
+/**
+ *
+ * @brief           Send a keyboard report the caller keeps up to date, without building a copy of it
+ *
+ * @param[in]       conn_id: HID connection index
+ * @param[in]       report: modifier byte, reserved byte and six keycodes, only read during the call
+ *
+ */
+bool esp_hidd_send_keyboard_report(uint16_t conn_id, const uint8_t report[HID_KEYBOARD_IN_RPT_LEN]);
 
-void esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys_x, int8_t mickeys_y, int8_t wheel);
+/**
+ *
+ * @brief           Check whether the NKRO keyboard report can be used on a connection
+ *
+ * @param[in]       conn_id: HID connection index
+ *
+ * @return          true in report protocol mode with an MTU that fits the report,
+ *                  false if the 6KRO report of esp_hidd_send_keyboard_report has to be used
+ *
+ */
+bool esp_hidd_nkro_available(uint16_t conn_id);
+
+bool esp_hidd_send_nkro_value(uint16_t conn_id, const uint8_t bitmap[HID_NKRO_IN_RPT_LEN]);
+
+/**
+ *
+ * @brief           Send a mouse report, returns like esp_hidd_send_consumer_value. With the queue full,
+ *                  movement with the same buttons is added to the newest queued report, clamped to
+ *                  the int8_t range, and only a button change is refused
+ *
+ */
+bool esp_hidd_send_mouse_value(uint16_t conn_id, uint8_t mouse_button, int8_t mickeys_x, int8_t mickeys_y, int8_t wheel);
+
+/**
+ *
+ * @brief           Hand queued reports to the stack, as far as it is not congested and fewer than
+ *                  HIDD_NTF_IN_FLIGHT notifications wait for their confirmation.
+ *                  The send functions queue their report and flush, call it again from the sending
+ *                  task after ESP_HIDD_EVENT_BLE_CONF or the end of ESP_HIDD_EVENT_BLE_CONGEST.
+ *
+ * @param[in]       conn_id: HID connection index
+ *
+ */
+void esp_hidd_flush(uint16_t conn_id);
+
+/**
+ *
+ * @brief           Check whether a keyboard report sent now goes to the stack right away,
+ *                  queued consumer and mouse reports wait behind it
+ *
+ * @param[in]       conn_id: HID connection index
+ *
+ * @return          true if no keyboard report is queued and the stack takes another notification
+ *
+ */
+bool esp_hidd_send_ready(uint16_t conn_id);
+
+/**
+ *
+ * @brief           Read the counters of the outbound report queue of a connection
+ *
+ * @param[in]       conn_id: HID connection index
+ * @param[out]      stats: counters since the connection was established, all 0 without a connection
+ *
+ */
+void esp_hidd_get_queue_stats(uint16_t conn_id, esp_hidd_queue_stats_t *stats);
 
 #ifdef __cplusplus
 }
@@ -18,43 +18,321 @@
 #include <stdbool.h>
 #include <stdio.h>
 #include "esp_log.h"
+#include "esp_timer.h"
 
 static hid_report_map_t *hid_dev_rpt_tbl;
 static uint8_t hid_dev_rpt_tbl_Len;
+// report map entry of every input report kind by protocol mode, NULL if the mode has none
+static hid_report_map_t *hid_dev_rpt_kind_tbl[HID_PROTOCOL_MODE_NB][HID_RPT_KIND_NB];
+// scheduling priority of every report map entry
+static uint8_t hid_dev_rpt_prio[HID_NUM_REPORTS];
 
-static hid_report_map_t *hid_dev_rpt_by_id(uint8_t id, uint8_t type)
+static const uint8_t hid_dev_kind_id[HID_RPT_KIND_NB] = {
+    [HID_RPT_KIND_KEY_IN] = HID_RPT_ID_KEY_IN,
+    [HID_RPT_KIND_NKRO_IN] = HID_RPT_ID_NKRO_IN,
+    [HID_RPT_KIND_CC_IN] = HID_RPT_ID_CC_IN,
+    [HID_RPT_KIND_MOUSE_IN] = HID_RPT_ID_MOUSE_IN,
+};
+
+static const uint8_t hid_dev_kind_prio[HID_RPT_KIND_NB] = {
+    [HID_RPT_KIND_KEY_IN] = HIDD_NTF_PRIO_KEYBOARD,
+    [HID_RPT_KIND_NKRO_IN] = HIDD_NTF_PRIO_KEYBOARD,
+    [HID_RPT_KIND_CC_IN] = HIDD_NTF_PRIO_CONSUMER,
+    [HID_RPT_KIND_MOUSE_IN] = HIDD_NTF_PRIO_MOUSE,
+};
+
+void hid_dev_register_reports(uint8_t num_reports, hid_report_map_t *p_report)
 {
-    hid_report_map_t *rpt = hid_dev_rpt_tbl;
+    if (num_reports > HID_NUM_REPORTS) {
+        ESP_LOGE(HID_LE_PRF_TAG, "%s(), %d reports, only the first %d are used", __func__, num_reports, HID_NUM_REPORTS);
+        num_reports = HID_NUM_REPORTS;
+    }
+    hid_dev_rpt_tbl = p_report;
+    hid_dev_rpt_tbl_Len = num_reports;
 
-    for (uint8_t i = hid_dev_rpt_tbl_Len; i > 0; i--, rpt++) {
-        if (rpt->id == id && rpt->type == type && rpt->mode == hidProtocolMode) {
-            return rpt;
+    // resolved once here, sending a report only indexes the table
+    memset(hid_dev_rpt_kind_tbl, 0, sizeof(hid_dev_rpt_kind_tbl));
+    for (uint8_t i = 0; i < num_reports; i++) {
+        hid_dev_rpt_prio[i] = HIDD_NTF_PRIO_MOUSE;
+        for (uint8_t kind = 0; kind < HID_RPT_KIND_NB; kind++) {
+            if (p_report[i].id == hid_dev_kind_id[kind] && p_report[i].type == HID_REPORT_TYPE_INPUT &&
+                p_report[i].mode < HID_PROTOCOL_MODE_NB) {
+                hid_dev_rpt_kind_tbl[p_report[i].mode][kind] = &p_report[i];
+                hid_dev_rpt_prio[i] = hid_dev_kind_prio[kind];
+            }
         }
     }
+    return;
+}
 
-    return NULL;
+// Keys of a keyboard report as a set of keycodes, bit k % 8 of set[k / 8] for keycode k
+static bool hid_dev_key_set(uint8_t id, const uint8_t *data, uint8_t length, uint8_t set[32])
+{
+    memset(set, 0, 32);
+    if (id == HID_RPT_ID_KEY_IN) {
+        // modifier byte (keycodes 0xE0-0xE7), reserved byte, keycodes
+        set[0xe0 / 8] = length > 0 ? data[0] : 0;
+        for (uint8_t i = 2; i < length; i++) {
+            set[data[i] / 8] |= 1 << (data[i] % 8);
+        }
+        set[0] &= ~1;   // KC_NO
+        return true;
+    }
+    if (id == HID_RPT_ID_NKRO_IN) {
+        // bit n is keycode 0x04 + n
+        for (uint8_t i = 0; i < length && i < 31; i++) {
+            set[i] |= data[i] << 4;
+            set[i + 1] |= data[i] >> 4;
+        }
+        return true;
+    }
+    return false;
 }
 
-void hid_dev_register_reports(uint8_t num_reports, hid_report_map_t *p_report)
+// Fields of the consumer report, each holds one value: numeric and channel,
+// volume up, volume down; button and selection
+static const uint8_t hid_dev_cc_fields[][4] = {
+    {(uint8_t)~HID_CC_RPT_NUMERIC_BITS, (uint8_t)~HID_CC_RPT_CHANNEL_BITS, HID_CC_RPT_VOLUME_UP, HID_CC_RPT_VOLUME_DOWN},
+    {(uint8_t)~HID_CC_RPT_BUTTON_BITS, (uint8_t)~HID_CC_RPT_SELECTION_BITS, 0, 0},
+};
+
+// Add the movement of mouse report n to the queued report q, as long as the buttons
+// stay the same and the sums fit, or clamped to the report range if saturate is set
+static bool hid_dev_mouse_add(hidd_ntf_t *q, const uint8_t *n, uint8_t length, bool saturate)
 {
-    hid_dev_rpt_tbl = p_report;
-    hid_dev_rpt_tbl_Len = num_reports;
-    return;
+    if (q->len != length || length == 0 || q->data[0] != n[0]) {
+        return false;
+    }
+    for (uint8_t i = 1; i < length && !saturate; i++) {
+        int16_t sum = (int8_t)q->data[i] + (int8_t)n[i];
+        if (sum < INT8_MIN || sum > INT8_MAX) {
+            return false;
+        }
+    }
+    for (uint8_t i = 1; i < length; i++) {
+        int16_t sum = (int8_t)q->data[i] + (int8_t)n[i];
+        q->data[i] = (uint8_t)(int8_t)(sum < INT8_MIN ? INT8_MIN : sum > INT8_MAX ? INT8_MAX : sum);
+    }
+    return true;
 }
 
-void hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
-                                    uint8_t id, uint8_t type, uint8_t length, uint8_t *data)
+// Whether report n can replace the queued report q without the host missing a transition:
+// n has to keep every key that q pressed (relative to the report p before it) and
+// must not press again any key that q released. Consumer reports merge the same way,
+// every field has to be unchanged either in q or in n
+static bool hid_dev_can_coalesce(uint8_t id, const hidd_ntf_t *p, const hidd_ntf_t *q,
+                                 const uint8_t *n, uint8_t length)
+{
+    uint8_t ps[32], qs[32], ns[32];
+
+    if (id == HID_RPT_ID_CC_IN) {
+        if (q->len != length || length > sizeof(hid_dev_cc_fields) / sizeof(hid_dev_cc_fields[0])) {
+            return false;
+        }
+        for (uint8_t i = 0; i < length; i++) {
+            uint8_t prev = i < p->len ? p->data[i] : 0;
+            for (uint8_t f = 0; f < sizeof(hid_dev_cc_fields[0]); f++) {
+                uint8_t mask = hid_dev_cc_fields[i][f];
+                if ((q->data[i] & mask) != (prev & mask) && (q->data[i] & mask) != (n[i] & mask)) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+    if (!hid_dev_key_set(id, n, length, ns)) {
+        // other reports hold a state, only an unchanged one is superseded
+        return q->len == length && memcmp(q->data, n, length) == 0;
+    }
+    hid_dev_key_set(id, p->data, p->len, ps);
+    hid_dev_key_set(id, q->data, q->len, qs);
+    for (int i = 0; i < 32; i++) {
+        if ((qs[i] & ~ps[i] & ~ns[i]) | (ps[i] & ~qs[i] & ns[i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// Notifications the stack has not confirmed yet, stray confirmations of other
+// characteristics can put the count below 0
+static int32_t hid_dev_in_flight(hidd_clcb_t *p_clcb)
+{
+    return (int32_t)(p_clcb->ntf_stats.sent - __atomic_load_n(&p_clcb->ntf_confirmed, __ATOMIC_ACQUIRE));
+}
+
+// Whether the stack takes a report of this priority now, consumer and mouse reports
+// leave HIDD_NTF_KEYBOARD_SLOTS notifications to keyboard reports
+static bool hid_dev_slot_free(hidd_clcb_t *p_clcb, uint8_t priority)
+{
+    int32_t limit = HIDD_NTF_IN_FLIGHT - (priority != HIDD_NTF_PRIO_KEYBOARD ? HIDD_NTF_KEYBOARD_SLOTS : 0);
+    return !__atomic_load_n(&p_clcb->congest, __ATOMIC_ACQUIRE) && hid_dev_in_flight(p_clcb) < limit;
+}
+
+// Hand report map entry index to the stack, which copies the value, and keep it as the state the host gets
+static bool hid_dev_notify(esp_gatt_if_t gatts_if, uint16_t conn_id, hidd_clcb_t *p_clcb, uint8_t index,
+                           uint8_t length, const uint8_t *data)
+{
+    if (esp_ble_gatts_send_indicate(gatts_if, conn_id, hid_dev_rpt_tbl[index].handle,
+                                    length, (uint8_t *)data, false) != ESP_OK) {
+        ESP_LOGW(HID_LE_PRF_TAG, "%s(), the stack refused report %d", __func__, hid_dev_rpt_tbl[index].id);
+        return false;
+    }
+    p_clcb->ntf_stats.sent++;
+    p_clcb->ntf_queue[index].last_len = length;
+    memcpy(p_clcb->ntf_queue[index].last, data, length);
+    return true;
+}
+
+static void hid_dev_flush_clcb(esp_gatt_if_t gatts_if, uint16_t conn_id, hidd_clcb_t *p_clcb);
+
+static bool hid_dev_queue_report(esp_gatt_if_t gatts_if, uint16_t conn_id, hidd_clcb_t *p_clcb,
+                                 hid_report_map_t *p_rpt, uint8_t length, const uint8_t *data)
+{
+
+    uint8_t index = p_rpt - hid_dev_rpt_tbl;
+    uint8_t priority = hid_dev_rpt_prio[index];
+    hidd_ntf_queue_t *queue = &p_clcb->ntf_queue[index];
+    p_clcb->ntf_stats.queued++;
+
+    // nothing of the same or a higher priority waits: straight to the stack, no copy in the queue
+    bool waiting = false;
+    for (uint8_t p = 0; p <= priority; p++) {
+        waiting |= p_clcb->ntf_pending[p] > 0;
+    }
+    if (!waiting && hid_dev_slot_free(p_clcb, priority) &&
+        hid_dev_notify(gatts_if, conn_id, p_clcb, index, length, data)) {
+        return true;
+    }
+
+    int64_t now = esp_timer_get_time();
+    if (queue->count > 0) {
+        hidd_ntf_t *newest = &queue->ntf[(queue->head + queue->count - 1) % HIDD_NTF_QUEUE_LEN];
+        bool merged;
+        if (p_rpt->id == HID_RPT_ID_MOUSE_IN) {
+            // a full queue keeps the movement up to the report range rather than refusing it all
+            merged = hid_dev_mouse_add(newest, data, length, queue->count == HIDD_NTF_QUEUE_LEN);
+        } else {
+            hidd_ntf_t prev = {.len = queue->last_len};
+            if (queue->count > 1) {
+                prev = queue->ntf[(queue->head + queue->count - 2) % HIDD_NTF_QUEUE_LEN];
+            } else {
+                memcpy(prev.data, queue->last, queue->last_len);
+            }
+            merged = hid_dev_can_coalesce(p_rpt->id, &prev, newest, data, length);
+            if (merged) {
+                newest->len = length;
+                memcpy(newest->data, data, length);
+            }
+        }
+        if (merged) {
+            // keeps its place in the order, the host gets the newer state a bit earlier
+            p_clcb->ntf_stats.coalesced++;
+            hid_dev_flush_clcb(gatts_if, conn_id, p_clcb);
+            return true;
+        }
+        if (queue->count == HIDD_NTF_QUEUE_LEN) {
+            // replacing the newest report could lose the release in it, the caller
+            // keeps its state and sends it again once a confirmation made room
+            p_clcb->ntf_stats.refused++;
+            hid_dev_flush_clcb(gatts_if, conn_id, p_clcb);
+            return false;
+        }
+    }
+    hidd_ntf_t *ntf = &queue->ntf[(queue->head + queue->count) % HIDD_NTF_QUEUE_LEN];
+    ntf->seq = p_clcb->ntf_seq++;
+    ntf->time = now;
+    ntf->len = length;
+    memcpy(ntf->data, data, length);
+    queue->count++;
+    p_clcb->ntf_pending[priority]++;
+    hid_dev_flush_clcb(gatts_if, conn_id, p_clcb);
+    return true;
+}
+
+bool hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
+                         hid_rpt_kind_t kind, uint8_t length, const uint8_t *data)
 {
     hid_report_map_t *p_rpt;
+    hidd_clcb_t *p_clcb;
 
     // get att handle for report
-    if ((p_rpt = hid_dev_rpt_by_id(id, type)) != NULL) {
-        // if notifications are enabled
-        ESP_LOGD(HID_LE_PRF_TAG, "%s(), send the report, handle = %d", __func__, p_rpt->handle);
-        esp_ble_gatts_send_indicate(gatts_if, conn_id, p_rpt->handle, length, data, false);
+    if ((p_rpt = hid_dev_rpt_kind_tbl[hidProtocolMode][kind]) == NULL) {
+        return true;
     }
-    
-    return;
+    if (length > HIDD_NTF_MAX_LEN) {
+        ESP_LOGE(HID_LE_PRF_TAG, "%s(), report %d is longer than %d bytes", __func__, p_rpt->id, HIDD_NTF_MAX_LEN);
+        return true;
+    }
+    // the link may go down meanwhile, the Bluetooth task then leaves its teardown to the release
+    if ((p_clcb = hidd_clcb_acquire(conn_id)) == NULL) {
+        return true;
+    }
+    bool taken = hid_dev_queue_report(gatts_if, conn_id, p_clcb, p_rpt, length, data);
+    hidd_clcb_release(p_clcb);
+    return taken;
+}
+
+static void hid_dev_flush_clcb(esp_gatt_if_t gatts_if, uint16_t conn_id, hidd_clcb_t *p_clcb)
+{
+    while (hid_dev_slot_free(p_clcb, HIDD_NTF_PRIO_KEYBOARD)) {
+        // the queue of the highest priority, reports of the same priority in the order they were sent
+        hidd_ntf_queue_t *next = NULL;
+        uint8_t index = 0, priority = 0;
+        for (uint8_t i = 0; i < hid_dev_rpt_tbl_Len; i++) {
+            hidd_ntf_queue_t *queue = &p_clcb->ntf_queue[i];
+            if (queue->count == 0) {
+                continue;
+            }
+            uint8_t p = hid_dev_rpt_prio[i];
+            if (next == NULL || p < priority ||
+                (p == priority && (int32_t)(queue->ntf[queue->head].seq - next->ntf[next->head].seq) < 0)) {
+                next = queue;
+                index = i;
+                priority = p;
+            }
+        }
+        if (next == NULL || !hid_dev_slot_free(p_clcb, priority)) {
+            return;
+        }
+        hidd_ntf_t *ntf = &next->ntf[next->head];
+        if (!hid_dev_notify(gatts_if, conn_id, p_clcb, index, ntf->len, ntf->data)) {
+            // stays queued, the next flush tries again
+            return;
+        }
+        if (priority == HIDD_NTF_PRIO_KEYBOARD) {
+            uint32_t wait = esp_timer_get_time() - ntf->time;
+            if (wait > p_clcb->ntf_stats.keyboard_wait_max_us) {
+                p_clcb->ntf_stats.keyboard_wait_max_us = wait;
+            }
+        }
+        next->head = (next->head + 1) % HIDD_NTF_QUEUE_LEN;
+        next->count--;
+        p_clcb->ntf_pending[priority]--;
+    }
+}
+
+void hid_dev_flush(esp_gatt_if_t gatts_if, uint16_t conn_id)
+{
+    hidd_clcb_t *p_clcb = hidd_clcb_acquire(conn_id);
+
+    if (p_clcb != NULL) {
+        hid_dev_flush_clcb(gatts_if, conn_id, p_clcb);
+        hidd_clcb_release(p_clcb);
+    }
+}
+
+bool hid_dev_send_ready(uint16_t conn_id)
+{
+    hidd_clcb_t *p_clcb = hidd_clcb_acquire(conn_id);
+
+    if (p_clcb == NULL) {
+        return false;
+    }
+    bool ready = p_clcb->ntf_pending[HIDD_NTF_PRIO_KEYBOARD] == 0 &&
+                 hid_dev_slot_free(p_clcb, HIDD_NTF_PRIO_KEYBOARD);
+    hidd_clcb_release(p_clcb);
+    return ready;
 }
 
 void hid_consumer_build_report(uint8_t *buffer, consumer_cmd_t cmd)
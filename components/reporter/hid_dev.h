@@ -234,6 +234,15 @@ typedef struct
   uint8_t     mode;             // Protocol mode (report or boot)
 } hid_report_map_t;
 
+// Input reports the device sends, the handle of each is looked up by protocol mode and kind
+typedef enum {
+    HID_RPT_KIND_KEY_IN,
+    HID_RPT_KIND_NKRO_IN,
+    HID_RPT_KIND_CC_IN,
+    HID_RPT_KIND_MOUSE_IN,
+    HID_RPT_KIND_NB,
+} hid_rpt_kind_t;
+
 // HID dev configuration structure
 typedef struct
 {
@@ -242,10 +251,21 @@ typedef struct
 
 } hid_dev_cfg_t;
 
+// Register the report map and resolve the handle of every input report kind in both protocol modes
 void hid_dev_register_reports(uint8_t num_reports, hid_report_map_t *p_report);
 
-void hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
-                                    uint8_t id, uint8_t type, uint8_t length, uint8_t *data);
+// Send an input report on the connection: straight from data if the stack takes it now and nothing
+// of the same or a higher priority waits, otherwise it is queued, see hid_dev_flush().
+// Returns false if the queue of the report is full, the caller has to send its state again later
+bool hid_dev_send_report(esp_gatt_if_t gatts_if, uint16_t conn_id,
+                         hid_rpt_kind_t kind, uint8_t length, const uint8_t *data);
+
+// Send queued reports by priority while the link is not congested and fewer than
+// HIDD_NTF_IN_FLIGHT notifications are unconfirmed, keyboard reports first
+void hid_dev_flush(esp_gatt_if_t gatts_if, uint16_t conn_id);
+
+// True if no keyboard report is queued and another notification can go out right away
+bool hid_dev_send_ready(uint16_t conn_id);
 
 void hid_consumer_build_report(uint8_t *buffer, consumer_cmd_t cmd);
 
@@ -14,6 +14,7 @@
 
 #include "hidd_le_prf_int.h"
 #include <string.h>
+#include "freertos/FreeRTOS.h"
 #include "esp_log.h"
 
 /// characteristic presentation information
@@ -83,6 +84,28 @@ static const uint8_t hidReportMap[] = {
     //
     0xC0, // End Collection
     //
+    // N-key rollover keyboard, one bit per key from A to Right GUI (modifiers included)
+    0x05, 0x01, // Usage Pg (Generic Desktop)
+    0x09, 0x06, // Usage (Keyboard)
+    0xA1, 0x01, // Collection: (Application)
+    0x85, 0x05, // Report Id (5)
+    //
+    0x05, 0x07, //   Usage Pg (Key Codes)
+    0x19, 0x04, //   Usage Min (4)
+    0x29, 0xE7, //   Usage Max (231)
+    0x15, 0x00, //   Log Min (0)
+    0x25, 0x01, //   Log Max (1)
+    0x75, 0x01, //   Report Size (1)
+    0x95, 0xE4, //   Report Count (228)
+    0x81, 0x02, //   Input: (Data, Variable, Absolute)
+    //
+    //   Bitmap padding to 29 bytes
+    0x95, 0x01, //   Report Count (1)
+    0x75, 0x04, //   Report Size (4)
+    0x81, 0x01, //   Input: (Constant)
+    //
+    0xC0, // End Collection
+    //
     0x05, 0x0C, // Usage Pg (Consumer Devices)
     0x09, 0x01, // Usage (Consumer Control)
     0xA1, 0x01, // Collection (Application)
@@ -212,9 +235,11 @@ struct gatts_profile_inst
 };
 
 hidd_le_env_t hidd_le_env;
+// the Bluetooth task allocates and frees the links, the sending task holds one while it works on its queues
+static portMUX_TYPE hidd_clcb_lock = portMUX_INITIALIZER_UNLOCKED;
 
 // HID report map length
-uint8_t hidReportMapLen = sizeof(hidReportMap);
+uint16_t hidReportMapLen = sizeof(hidReportMap);
 uint8_t hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
 
 // HID report mapping table
@@ -238,6 +263,10 @@ static uint8_t hidReportRefMouseIn[HID_REPORT_REF_LEN] =
 static uint8_t hidReportRefKeyIn[HID_REPORT_REF_LEN] =
     {HID_RPT_ID_KEY_IN, HID_REPORT_TYPE_INPUT};
 
+// HID Report Reference characteristic descriptor, NKRO key input
+static uint8_t hidReportRefNkroIn[HID_REPORT_REF_LEN] =
+    {HID_RPT_ID_NKRO_IN, HID_REPORT_TYPE_INPUT};
+
 // HID Report Reference characteristic descriptor, LED output
 static uint8_t hidReportRefLedOut[HID_REPORT_REF_LEN] =
     {HID_RPT_ID_LED_OUT, HID_REPORT_TYPE_OUTPUT};
@@ -359,6 +388,15 @@ static esp_gatts_attr_db_t hidd_le_gatt_db[HIDD_LE_IDX_NB] =
         // Report Characteristic - Report Reference Descriptor
         [HIDD_LE_IDX_REPORT_KEY_IN_REP_REF] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&hid_report_ref_descr_uuid, ESP_GATT_PERM_READ, sizeof(hidReportRefKeyIn), sizeof(hidReportRefKeyIn), hidReportRefKeyIn}},
 
+        // Report Characteristic Declaration
+        [HIDD_LE_IDX_REPORT_NKRO_IN_CHAR] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_notify}},
+        // Report Characteristic Value
+        [HIDD_LE_IDX_REPORT_NKRO_IN_VAL] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&hid_report_uuid, ESP_GATT_PERM_READ, HIDD_LE_REPORT_MAX_LEN, 0, NULL}},
+        // Report NKRO KEY INPUT Characteristic - Client Characteristic Configuration Descriptor
+        [HIDD_LE_IDX_REPORT_NKRO_IN_CCC] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_client_config_uuid, (ESP_GATT_PERM_READ | ESP_GATT_PERM_WRITE), sizeof(uint16_t), 0, NULL}},
+        // Report Characteristic - Report Reference Descriptor
+        [HIDD_LE_IDX_REPORT_NKRO_IN_REP_REF] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&hid_report_ref_descr_uuid, ESP_GATT_PERM_READ, sizeof(hidReportRefNkroIn), sizeof(hidReportRefNkroIn), hidReportRefNkroIn}},
+
         // Report Characteristic Declaration
         [HIDD_LE_IDX_REPORT_LED_OUT_CHAR] = {{ESP_GATT_AUTO_RSP}, {ESP_UUID_LEN_16, (uint8_t *)&character_declaration_uuid, ESP_GATT_PERM_READ, CHAR_DECLARATION_SIZE, CHAR_DECLARATION_SIZE, (uint8_t *)&char_prop_read_write_write_nr}},
 
@@ -448,10 +486,51 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
     }
     case ESP_GATTS_CONF_EVT:
     {
+        // also sent for notifications, once the stack handed them to L2CAP
+        esp_hidd_cb_param_t cb_param = {0};
+        hidd_clcb_t *p_clcb = hidd_clcb_find(param->conf.conn_id);
+        uint16_t svc_handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_SVC];
+        if (p_clcb != NULL && param->conf.handle >= svc_handle && param->conf.handle < svc_handle + HIDD_LE_IDX_NB)
+        {
+            // the report queue sends the next report once the sending task flushes it
+            __atomic_add_fetch(&p_clcb->ntf_confirmed, 1, __ATOMIC_RELEASE);
+        }
+        cb_param.conf.conn_id = param->conf.conn_id;
+        cb_param.conf.status = param->conf.status;
+        if (hidd_le_env.hidd_cb != NULL)
+        {
+            (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_CONF, &cb_param);
+        }
+        break;
+    }
+    case ESP_GATTS_CONGEST_EVT:
+    {
+        esp_hidd_cb_param_t cb_param = {0};
+        hidd_clcb_t *p_clcb = hidd_clcb_find(param->congest.conn_id);
+        if (p_clcb != NULL)
+        {
+            __atomic_store_n(&p_clcb->congest, param->congest.congested, __ATOMIC_RELEASE);
+        }
+        cb_param.congest.conn_id = param->congest.conn_id;
+        cb_param.congest.congested = param->congest.congested;
+        if (hidd_le_env.hidd_cb != NULL)
+        {
+            (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_CONGEST, &cb_param);
+        }
         break;
     }
     case ESP_GATTS_CREATE_EVT:
         break;
+    case ESP_GATTS_MTU_EVT:
+    {
+        // the NKRO report only fits into a notification once the client raised the MTU
+        hidd_clcb_t *p_clcb = hidd_clcb_find(param->mtu.conn_id);
+        if (p_clcb != NULL)
+        {
+            p_clcb->mtu = param->mtu.mtu;
+        }
+        break;
+    }
     case ESP_GATTS_CONNECT_EVT:
     {
         esp_hidd_cb_param_t cb_param = {0};
@@ -459,6 +538,10 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
         memcpy(cb_param.connect.remote_bda, param->connect.remote_bda, sizeof(esp_bd_addr_t));
         cb_param.connect.conn_id = param->connect.conn_id;
         hidd_clcb_alloc(param->connect.conn_id, param->connect.remote_bda);
+        // every connection starts in report protocol mode, until the host writes the protocol mode
+        hidProtocolMode = HID_PROTOCOL_MODE_REPORT;
+        esp_ble_gatts_set_attr_value(hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_PROTO_MODE_VAL],
+                                     sizeof(hidProtocolMode), &hidProtocolMode);
         esp_ble_set_encryption(param->connect.remote_bda, ESP_BLE_SEC_ENCRYPT_NO_MITM);
         if (hidd_le_env.hidd_cb != NULL)
         {
@@ -468,9 +551,20 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
     }
     case ESP_GATTS_DISCONNECT_EVT:
     {
+        esp_hidd_cb_param_t cb_param = {0};
+        hidd_clcb_t *p_clcb = hidd_clcb_find(param->disconnect.conn_id);
+        if (p_clcb != NULL)
+        {
+            ESP_LOGI(HID_LE_PRF_TAG, "reports queued %u, coalesced %u, refused %u, sent %u, keyboard waited %uus at most",
+                     p_clcb->ntf_stats.queued, p_clcb->ntf_stats.coalesced,
+                     p_clcb->ntf_stats.refused, p_clcb->ntf_stats.sent,
+                     p_clcb->ntf_stats.keyboard_wait_max_us);
+        }
         if (hidd_le_env.hidd_cb != NULL)
         {
-            (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_DISCONNECT, NULL);
+            cb_param.disconnect.conn_id = param->disconnect.conn_id;
+            memcpy(cb_param.disconnect.remote_bda, param->disconnect.remote_bda, sizeof(esp_bd_addr_t));
+            (hidd_le_env.hidd_cb)(ESP_HIDD_EVENT_BLE_DISCONNECT, &cb_param);
         }
         hidd_clcb_dealloc(param->disconnect.conn_id);
         break;
@@ -480,6 +574,14 @@ void esp_hidd_prf_cb_hdl(esp_gatts_cb_event_t event, esp_gatt_if_t gatts_if,
     case ESP_GATTS_WRITE_EVT:
     {
         esp_hidd_cb_param_t cb_param = {0};
+        // the stack answers the write itself and only updates its copy of the attribute
+        if (param->write.handle == hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_PROTO_MODE_VAL] &&
+            param->write.len == sizeof(hidProtocolMode))
+        {
+            // other values are reserved, the report handles are only known for these two
+            hidProtocolMode = param->write.value[0] == HID_PROTOCOL_MODE_BOOT ? HID_PROTOCOL_MODE_BOOT : HID_PROTOCOL_MODE_REPORT;
+            ESP_LOGI(HID_LE_PRF_TAG, "protocol mode %s", hidProtocolMode == HID_PROTOCOL_MODE_BOOT ? "boot" : "report");
+        }
         if (param->write.handle == hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_LED_OUT_VAL] &&
             hidd_le_env.hidd_cb != NULL)
         {
@@ -556,6 +658,7 @@ void hidd_clcb_alloc(uint16_t conn_id, esp_bd_addr_t bda)
     uint8_t i_clcb = 0;
     hidd_clcb_t *p_clcb = NULL;
 
+    portENTER_CRITICAL(&hidd_clcb_lock);
     for (i_clcb = 0, p_clcb = hidd_le_env.hidd_clcb; i_clcb < HID_MAX_APPS; i_clcb++, p_clcb++)
     {
         if (!p_clcb->in_use)
@@ -563,10 +666,14 @@ void hidd_clcb_alloc(uint16_t conn_id, esp_bd_addr_t bda)
             p_clcb->in_use = true;
             p_clcb->conn_id = conn_id;
             p_clcb->connected = true;
+            p_clcb->mtu = ESP_GATT_DEF_BLE_MTU_SIZE;
             memcpy(p_clcb->remote_bda, bda, ESP_BD_ADDR_LEN);
-            break;
+            portEXIT_CRITICAL(&hidd_clcb_lock);
+            return;
         }
     }
+    portEXIT_CRITICAL(&hidd_clcb_lock);
+    ESP_LOGW(HID_LE_PRF_TAG, "no free link for conn_id %d", conn_id);
     return;
 }
 
@@ -575,15 +682,73 @@ bool hidd_clcb_dealloc(uint16_t conn_id)
     uint8_t i_clcb = 0;
     hidd_clcb_t *p_clcb = NULL;
 
+    portENTER_CRITICAL(&hidd_clcb_lock);
     for (i_clcb = 0, p_clcb = hidd_le_env.hidd_clcb; i_clcb < HID_MAX_APPS; i_clcb++, p_clcb++)
     {
-        memset(p_clcb, 0, sizeof(hidd_clcb_t));
-        return true;
+        // only the link that went down, a late event must not wipe the next one
+        if (p_clcb->in_use && p_clcb->conn_id == conn_id && !p_clcb->closing)
+        {
+            if (p_clcb->busy)
+            {
+                // the sending task is in its queues, its release clears the link
+                p_clcb->closing = true;
+                p_clcb->connected = false;
+            }
+            else
+            {
+                memset(p_clcb, 0, sizeof(hidd_clcb_t));
+            }
+            portEXIT_CRITICAL(&hidd_clcb_lock);
+            return true;
+        }
     }
+    portEXIT_CRITICAL(&hidd_clcb_lock);
 
     return false;
 }
 
+hidd_clcb_t *hidd_clcb_acquire(uint16_t conn_id)
+{
+    portENTER_CRITICAL(&hidd_clcb_lock);
+    hidd_clcb_t *p_clcb = hidd_clcb_find(conn_id);
+    if (p_clcb != NULL && p_clcb->closing)
+    {
+        p_clcb = NULL;
+    }
+    if (p_clcb != NULL)
+    {
+        p_clcb->busy++;
+    }
+    portEXIT_CRITICAL(&hidd_clcb_lock);
+    return p_clcb;
+}
+
+void hidd_clcb_release(hidd_clcb_t *p_clcb)
+{
+    portENTER_CRITICAL(&hidd_clcb_lock);
+    if (--p_clcb->busy == 0 && p_clcb->closing)
+    {
+        // under the lock, or the Bluetooth task could allocate the half cleared link
+        memset(p_clcb, 0, sizeof(hidd_clcb_t));
+    }
+    portEXIT_CRITICAL(&hidd_clcb_lock);
+}
+
+hidd_clcb_t *hidd_clcb_find(uint16_t conn_id)
+{
+    uint8_t i_clcb = 0;
+    hidd_clcb_t *p_clcb = NULL;
+
+    for (i_clcb = 0, p_clcb = hidd_le_env.hidd_clcb; i_clcb < HID_MAX_APPS; i_clcb++, p_clcb++)
+    {
+        if (p_clcb->in_use && p_clcb->conn_id == conn_id)
+        {
+            return p_clcb;
+        }
+    }
+    return NULL;
+}
+
 static struct gatts_profile_inst heart_rate_profile_tab[PROFILE_NUM] = {
     [PROFILE_APP_IDX] = {
         .gatts_cb = esp_hidd_prf_cb_hdl,
@@ -727,6 +892,13 @@ static void hid_add_id_tbl(void)
     hid_rpt_map[7].cccdHandle = 0;
     hid_rpt_map[7].mode = HID_PROTOCOL_MODE_REPORT;
 
+    // NKRO key input report, report protocol mode only
+    hid_rpt_map[8].id = hidReportRefNkroIn[0];
+    hid_rpt_map[8].type = hidReportRefNkroIn[1];
+    hid_rpt_map[8].handle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_NKRO_IN_VAL];
+    hid_rpt_map[8].cccdHandle = hidd_le_env.hidd_inst.att_tbl[HIDD_LE_IDX_REPORT_NKRO_IN_CCC];
+    hid_rpt_map[8].mode = HID_PROTOCOL_MODE_REPORT;
+
     // Setup report ID map
     hid_dev_register_reports(HID_NUM_REPORTS, hid_rpt_map);
 }
\ No newline at end of file
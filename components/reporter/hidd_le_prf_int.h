@@ -38,6 +38,7 @@
 #define HIDD_SUB_VER     0x00  //Version + Subversion
 #define HIDD_VERSION     ((HIDD_GREAT_VER<<8)|HIDD_SUB_VER)  //Version + Subversion
 
+// One host at a time, a host switch ends the link before advertising to the next host (host.h)
 #define HID_MAX_APPS                 1
 
 // Number of HID reports defined in the service
@@ -48,6 +49,7 @@
 #define HID_RPT_ID_CC_IN         2   //Consumer Control input report ID
 #define HID_RPT_ID_MOUSE_IN      3   // Mouse input report ID
 #define HID_RPT_ID_VENDOR_OUT    4   // Vendor output report ID
+#define HID_RPT_ID_NKRO_IN       5   // NKRO keyboard input report ID
 #define HID_RPT_ID_LED_OUT       1  // LED output report ID
 #define HID_RPT_ID_FEATURE       0  // Feature report ID
 
@@ -88,6 +90,7 @@
 /* HID protocol mode values */
 #define HID_PROTOCOL_MODE_BOOT          0x00      // Boot Protocol Mode
 #define HID_PROTOCOL_MODE_REPORT        0x01      // Report Protocol Mode
+#define HID_PROTOCOL_MODE_NB            2
 
 /* Attribute value lengths */
 #define HID_PROTOCOL_MODE_LEN           1         // HID Protocol Mode
@@ -133,6 +136,11 @@ enum {
     HIDD_LE_IDX_REPORT_KEY_IN_VAL,
     HIDD_LE_IDX_REPORT_KEY_IN_CCC,
     HIDD_LE_IDX_REPORT_KEY_IN_REP_REF,
+    //Report NKRO key input
+    HIDD_LE_IDX_REPORT_NKRO_IN_CHAR,
+    HIDD_LE_IDX_REPORT_NKRO_IN_VAL,
+    HIDD_LE_IDX_REPORT_NKRO_IN_CCC,
+    HIDD_LE_IDX_REPORT_NKRO_IN_REP_REF,
     ///Report Led output
     HIDD_LE_IDX_REPORT_LED_OUT_CHAR,
     HIDD_LE_IDX_REPORT_LED_OUT_VAL,
@@ -253,14 +261,56 @@ typedef struct {
 } hidd_feature_t;
 
 
+// Reports queued per report characteristic, once full new reports are refused
+#define HIDD_NTF_QUEUE_LEN       8
+// Longest queued report, the NKRO bitmap
+#define HIDD_NTF_MAX_LEN         HID_NKRO_IN_RPT_LEN
+// Scheduling priority of the queued reports, lower goes out first
+#define HIDD_NTF_PRIO_KEYBOARD   0
+#define HIDD_NTF_PRIO_CONSUMER   1
+#define HIDD_NTF_PRIO_MOUSE      2
+#define HIDD_NTF_PRIO_NB         3
+// In-flight notifications kept for keyboard reports: a consumer or mouse report never takes the
+// last one, so a key report waits at most for the confirmation of an earlier key report
+#define HIDD_NTF_KEYBOARD_SLOTS  1
+
+// Queued input report
+typedef struct {
+    uint32_t    seq;              // order of the reports over all queues
+    int64_t     time;             // esp_timer time it was queued at
+    uint8_t     len;
+    uint8_t     data[HIDD_NTF_MAX_LEN];
+} hidd_ntf_t;
+
+// Outbound queue of one report characteristic, see hid_dev_send_report()
+typedef struct {
+    uint8_t     head;
+    uint8_t     count;
+    hidd_ntf_t  ntf[HIDD_NTF_QUEUE_LEN];
+    uint8_t     last_len;         // last report handed to the stack, the state the host gets
+    uint8_t     last[HIDD_NTF_MAX_LEN];
+} hidd_ntf_queue_t;
+
 typedef struct {
     bool                        in_use;
-    bool                        congest;
+    bool                        congest;          // set by the Bluetooth task
     uint16_t                  conn_id;
     bool                        connected;
     esp_bd_addr_t         remote_bda;
     uint32_t                  trans_id;
     uint8_t                    cur_srvc_id;
+    uint16_t                  mtu;
+    // outbound reports, one queue per entry of the report map; only the sending task
+    // touches them, the Bluetooth task counts the confirmations
+    hidd_ntf_queue_t          ntf_queue[HID_NUM_REPORTS];
+    uint8_t                   ntf_pending[HIDD_NTF_PRIO_NB];   // queued reports per priority
+    uint32_t                  ntf_seq;
+    uint32_t                  ntf_confirmed;
+    esp_hidd_queue_stats_t    ntf_stats;
+    // hidd_clcb_acquire() calls of the sending task not released yet, and a disconnect
+    // that came meanwhile: the last release tears the link down instead of the Bluetooth task
+    uint8_t                   busy;
+    bool                      closing;
 
 } hidd_clcb_t;
 
@@ -332,6 +382,13 @@ void hidd_clcb_alloc (uint16_t conn_id, esp_bd_addr_t bda);
 
 bool hidd_clcb_dealloc (uint16_t conn_id);
 
+hidd_clcb_t *hidd_clcb_find (uint16_t conn_id);
+
+/* Link of conn_id for the sending task, kept until hidd_clcb_release() even if it goes down meanwhile */
+hidd_clcb_t *hidd_clcb_acquire (uint16_t conn_id);
+
+void hidd_clcb_release (hidd_clcb_t *p_clcb);
+
 void hidd_le_create_service(esp_gatt_if_t gatts_if);
 
 void hidd_set_attr_value(uint16_t handle, uint16_t val_len, const uint8_t *value);
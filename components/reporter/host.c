@@ -0,0 +1,304 @@
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "esp_log.h"
+#include "nvs.h"
+
+#include "host.h"
+
+#define HOST_TAG "host"
+
+typedef struct
+{
+    bool bonded;
+    esp_ble_addr_type_t addr_type;
+    esp_bd_addr_t addr; // identity address the bond is stored under
+} host_profile_t;
+
+// profiles and the selected one are kept in RAM, a switch or a reconnect never waits for flash;
+// the report task changes them, host_connected() in the Bluetooth task binds an empty one
+static portMUX_TYPE host_lock = portMUX_INITIALIZER_UNLOCKED;
+static host_profile_t profiles[HOST_PROFILES];
+static uint8_t active;
+
+// events of the Bluetooth task, handed over to host_tick() under the lock
+#define EVENT_ADV_READY 0x1
+#define EVENT_ADV_STOPPED 0x2
+#define EVENT_LINK_UP 0x4
+#define EVENT_LINK_DOWN 0x8
+#define EVENT_BOUND 0x10
+static uint32_t events;
+static esp_bd_addr_t event_bda;
+
+typedef enum
+{
+    ADV_OFF,
+    ADV_DIRECTED,
+    ADV_UNDIRECTED,
+    ADV_STOPPING,
+} adv_state_t;
+
+// state of the report task
+static esp_ble_adv_params_t adv_params;
+static bool adv_ready;
+static adv_state_t adv = ADV_OFF;
+static int64_t direct_until;
+static bool link;
+static esp_bd_addr_t link_bda;
+static bool switching;     // a profile was selected, the link and the advertising have to go first
+static bool disconnecting;
+static bool save;          // the profiles changed since they were written to NVS
+
+void host_init(const esp_ble_adv_params_t *params)
+{
+    adv_params = *params;
+    nvs_handle my_handle;
+    if (nvs_open("config_c", NVS_READWRITE, &my_handle) != ESP_OK)
+    {
+        ESP_LOGE(HOST_TAG, "error opening NVS");
+        return;
+    }
+    size_t size = sizeof(profiles);
+    if (nvs_get_blob(my_handle, "hosts", profiles, &size) != ESP_OK || size != sizeof(profiles))
+    {
+        ESP_LOGI(HOST_TAG, "no host profiles in NVS, the first host to pair gets profile 0");
+        memset(profiles, 0, sizeof(profiles));
+    }
+    if (nvs_get_u8(my_handle, "host", &active) != ESP_OK || active >= HOST_PROFILES)
+    {
+        active = 0;
+    }
+    nvs_close(my_handle);
+    ESP_LOGI(HOST_TAG, "host profile %d selected", active);
+}
+
+static void host_save()
+{
+    host_profile_t copy[HOST_PROFILES];
+    portENTER_CRITICAL(&host_lock);
+    memcpy(copy, profiles, sizeof(copy));
+    uint8_t selected = active;
+    portEXIT_CRITICAL(&host_lock);
+
+    nvs_handle my_handle;
+    if (nvs_open("config_c", NVS_READWRITE, &my_handle) != ESP_OK)
+    {
+        ESP_LOGE(HOST_TAG, "error opening NVS");
+        return;
+    }
+    if (nvs_set_blob(my_handle, "hosts", copy, sizeof(copy)) != ESP_OK ||
+        nvs_set_u8(my_handle, "host", selected) != ESP_OK || nvs_commit(my_handle) != ESP_OK)
+    {
+        ESP_LOGE(HOST_TAG, "error saving NVS - host profiles");
+    }
+    nvs_close(my_handle);
+}
+
+void host_select(uint8_t profile, bool pair)
+{
+    if (profile >= HOST_PROFILES)
+    {
+        ESP_LOGW(HOST_TAG, "no host profile %d", profile);
+        return;
+    }
+    esp_bd_addr_t forget;
+    bool remove = false;
+    portENTER_CRITICAL(&host_lock);
+    bool changed = profile != active || pair;
+    if (pair && profiles[profile].bonded)
+    {
+        memcpy(forget, profiles[profile].addr, sizeof(esp_bd_addr_t));
+        profiles[profile].bonded = false;
+        remove = true;
+    }
+    active = profile;
+    portEXIT_CRITICAL(&host_lock);
+
+    if (remove)
+    {
+        // ends its link as well, if it is the connected host
+        esp_ble_remove_bond_device(forget);
+    }
+    if (changed)
+    {
+        ESP_LOGI(HOST_TAG, "host profile %d selected%s", profile, pair ? " for pairing" : "");
+        switching = true;
+        save = true;
+    }
+}
+
+uint8_t host_active()
+{
+    return active;
+}
+
+static void host_event(uint32_t set, uint32_t clear)
+{
+    portENTER_CRITICAL(&host_lock);
+    events = (events & ~clear) | set;
+    portEXIT_CRITICAL(&host_lock);
+}
+
+void host_adv_ready()
+{
+    host_event(EVENT_ADV_READY, 0);
+}
+
+void host_adv_stopped()
+{
+    host_event(EVENT_ADV_STOPPED, 0);
+}
+
+void host_link_up(const esp_bd_addr_t bda)
+{
+    portENTER_CRITICAL(&host_lock);
+    memcpy(event_bda, bda, sizeof(esp_bd_addr_t));
+    events = (events & ~EVENT_LINK_DOWN) | EVENT_LINK_UP;
+    portEXIT_CRITICAL(&host_lock);
+}
+
+void host_link_down()
+{
+    host_event(EVENT_LINK_DOWN, EVENT_LINK_UP);
+}
+
+bool host_connected(const esp_bd_addr_t bda, esp_ble_addr_type_t addr_type)
+{
+    bool accepted = false, other = false;
+    uint8_t selected;
+    portENTER_CRITICAL(&host_lock);
+    selected = active;
+    for (int i = 0; i < HOST_PROFILES; i++)
+    {
+        other |= i != active && profiles[i].bonded && memcmp(profiles[i].addr, bda, sizeof(esp_bd_addr_t)) == 0;
+    }
+    host_profile_t *profile = &profiles[active];
+    if (profile->bonded)
+    {
+        accepted = memcmp(profile->addr, bda, sizeof(esp_bd_addr_t)) == 0;
+    }
+    else if (!other)
+    {
+        profile->bonded = true;
+        profile->addr_type = addr_type;
+        memcpy(profile->addr, bda, sizeof(esp_bd_addr_t));
+        events |= EVENT_BOUND;
+        accepted = true;
+    }
+    portEXIT_CRITICAL(&host_lock);
+
+    esp_bd_addr_t addr;
+    memcpy(addr, bda, sizeof(esp_bd_addr_t));
+    if (other)
+    {
+        ESP_LOGI(HOST_TAG, "the host of another profile connected while profile %d is selected, disconnecting", selected);
+        esp_ble_gap_disconnect(addr);
+    }
+    else if (!accepted)
+    {
+        ESP_LOGW(HOST_TAG, "profile %d has a host already, pair it again to replace it", selected);
+        esp_ble_remove_bond_device(addr);
+    }
+    return accepted;
+}
+
+static void advertise(int64_t now, bool directed)
+{
+    portENTER_CRITICAL(&host_lock);
+    host_profile_t profile = profiles[active];
+    portEXIT_CRITICAL(&host_lock);
+
+    esp_ble_adv_params_t params = adv_params;
+    if (directed && profile.bonded)
+    {
+        // only the bonded host can connect, and it does so within a few advertising events
+        params.adv_type = ADV_TYPE_DIRECT_IND_HIGH;
+        memcpy(params.peer_addr, profile.addr, sizeof(esp_bd_addr_t));
+        params.peer_addr_type = profile.addr_type == BLE_ADDR_TYPE_PUBLIC || profile.addr_type == BLE_ADDR_TYPE_RPA_PUBLIC
+                                    ? BLE_ADDR_TYPE_PUBLIC
+                                    : BLE_ADDR_TYPE_RANDOM;
+        adv = ADV_DIRECTED;
+        direct_until = now + HOST_DIRECT_MS * 1000LL;
+    }
+    else
+    {
+        // a host that ignores directed advertising, or a new one to pair with
+        adv = ADV_UNDIRECTED;
+    }
+    if (esp_ble_gap_start_advertising(&params) != ESP_OK)
+    {
+        ESP_LOGW(HOST_TAG, "cannot start %s advertising", adv == ADV_DIRECTED ? "directed" : "undirected");
+    }
+}
+
+int64_t host_tick(int64_t now)
+{
+    portENTER_CRITICAL(&host_lock);
+    uint32_t e = events;
+    events = 0;
+    esp_bd_addr_t bda;
+    memcpy(bda, event_bda, sizeof(esp_bd_addr_t));
+    portEXIT_CRITICAL(&host_lock);
+
+    if (e & EVENT_ADV_READY)
+    {
+        adv_ready = true;
+    }
+    if ((e & EVENT_ADV_STOPPED) && adv == ADV_STOPPING)
+    {
+        adv = ADV_OFF;
+    }
+    if (e & EVENT_LINK_DOWN)
+    {
+        link = false;
+        disconnecting = false;
+        adv = ADV_OFF;
+    }
+    if (e & EVENT_LINK_UP)
+    {
+        // a connection ends the advertising
+        link = true;
+        memcpy(link_bda, bda, sizeof(esp_bd_addr_t));
+        adv = ADV_OFF;
+    }
+    if (e & EVENT_BOUND)
+    {
+        save = true;
+    }
+
+    if (switching)
+    {
+        if (link && !disconnecting)
+        {
+            esp_ble_gap_disconnect(link_bda);
+            disconnecting = true;
+        }
+        else if (adv == ADV_DIRECTED || adv == ADV_UNDIRECTED)
+        {
+            esp_ble_gap_stop_advertising();
+            adv = ADV_STOPPING;
+        }
+        if (!link && adv == ADV_OFF)
+        {
+            switching = false;
+        }
+    }
+    if (!switching && !link && adv_ready)
+    {
+        if (adv == ADV_OFF)
+        {
+            advertise(now, true);
+        }
+        else if (adv == ADV_DIRECTED && now >= direct_until)
+        {
+            // the controller ended the directed advertising by now
+            advertise(now, false);
+        }
+    }
+    // written once the advertising is on its way, the switch does not wait for flash
+    if (save)
+    {
+        host_save();
+        save = false;
+    }
+    return adv == ADV_DIRECTED ? direct_until : INT64_MAX;
+}
@@ -0,0 +1,59 @@
+#ifndef _HOST_H_
+#define _HOST_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "esp_bt_defs.h"
+#include "esp_gap_ble_api.h"
+
+#include "action.h"
+
+/** @brief Number of host profiles, each one is bonded with one host. */
+#define HOST_PROFILES 3
+/** @brief Time in milliseconds of high duty cycle directed advertising to the selected host before
+ * falling back to undirected advertising, a bit over the 1.28s the controller stops it after. */
+#define HOST_DIRECT_MS 1300
+
+/** @brief Host operations, in bits 8-11 of an ACTION_HOST action. */
+#define HOST_OP_SELECT 0 // switch to the host of the profile
+#define HOST_OP_PAIR 1   // forget the host of the profile and wait for a new one to pair with it
+/** @brief Keymap action that switches to host profile 0 to HOST_PROFILES - 1. */
+#define HOST_SELECT(profile) ACTION(ACTION_HOST, HOST_OP_SELECT << 8 | (profile))
+/** @brief Keymap action that pairs host profile 0 to HOST_PROFILES - 1 with a new host. */
+#define HOST_PAIR(profile) ACTION(ACTION_HOST, HOST_OP_PAIR << 8 | (profile))
+
+/** @brief Load the profiles from NVS, adv_params are the undirected advertising parameters. */
+void host_init(const esp_ble_adv_params_t *adv_params);
+
+/** @brief Switch to a profile: end the link and advertise to its host. Called from the report task. */
+void host_select(uint8_t profile, bool pair);
+
+/** @brief The profile the keyboard is connected to or advertises to. */
+uint8_t host_active();
+
+/** @brief The advertising data is set, advertising can start. Called from the Bluetooth task. */
+void host_adv_ready();
+
+/** @brief Advertising stopped on request. Called from the Bluetooth task. */
+void host_adv_stopped();
+
+/** @brief A host connected, advertising has ended. Called from the Bluetooth task. */
+void host_link_up(const esp_bd_addr_t bda);
+
+/** @brief The link is gone. Called from the Bluetooth task. */
+void host_link_down();
+
+/** @brief A host completed authentication, an empty selected profile is bonded with it.
+ *
+ * Called from the Bluetooth task. The host of another profile is disconnected and a new
+ * host loses its bond if the selected profile already has one.
+ * @return true if the host belongs to the selected profile */
+bool host_connected(const esp_bd_addr_t bda, esp_ble_addr_type_t addr_type);
+
+/** @brief Handle the events of the Bluetooth task, tear down the link and advertise for a switch.
+ *
+ * @return esp_timer time to call again at, INT64_MAX if nothing is due */
+int64_t host_tick(int64_t now);
+
+#endif
@@ -0,0 +1,141 @@
+#include "esp_log.h"
+
+#include "layer.h"
+
+#define LAYER_TAG "layer"
+
+static const action_t *const *layer_keymap;
+static int layer_count;
+
+static uint32_t layer_mask;                 // layers switched on by MO, TG and OSL
+static uint8_t layer_default;
+static action_t layer_resolved[NBUTTON]; // effective action of every key for the active layers
+static action_t layer_pressed[NBUTTON];  // action every held key resolved to when it was pressed
+
+static int oneshot_layer = -1;
+static bool oneshot_held, oneshot_used;
+
+/** @brief Recompute layer_resolved, walking the active layers from the highest down. */
+static void layer_resolve()
+{
+    uint32_t active = layer_mask | (1UL << layer_default);
+    for (int key = 0; key < NBUTTON; key++)
+    {
+        action_t action = KC_NO;
+        for (uint32_t layers = active; layers; layers &= ~(1UL << (31 - __builtin_clz(layers))))
+        {
+            action = layer_keymap[31 - __builtin_clz(layers)][key];
+            if (action != KC_TRANSPARENT)
+            {
+                break;
+            }
+        }
+        layer_resolved[key] = action == KC_TRANSPARENT ? KC_NO : action;
+    }
+    ESP_LOGD(LAYER_TAG, "layers 0x%08x, default %d", layer_mask, layer_default);
+}
+
+static void layer_set(int layer, bool on)
+{
+    uint32_t mask = on ? layer_mask | (1UL << layer) : layer_mask & ~(1UL << layer);
+    if (mask != layer_mask)
+    {
+        layer_mask = mask;
+        layer_resolve();
+    }
+}
+
+static void oneshot_end()
+{
+    layer_set(oneshot_layer, false);
+    oneshot_layer = -1;
+}
+
+void layer_init(const action_t *const *keymap, int nlayers)
+{
+    layer_keymap = keymap;
+    layer_count = nlayers < LAYER_MAX ? nlayers : LAYER_MAX;
+    layer_mask = 0;
+    layer_default = 0;
+    oneshot_layer = -1;
+    layer_resolve();
+}
+
+void layer_action(action_t action, bool pressed)
+{
+    int layer = action & 0xff;
+    if (layer >= layer_count)
+    {
+        ESP_LOGW(LAYER_TAG, "layer key 0x%04x for a layer that is not in the keymap", action);
+        return;
+    }
+    switch ((action >> 8) & 0xf)
+    {
+    case LAYER_MOMENTARY:
+        layer_set(layer, pressed);
+        break;
+    case LAYER_TOGGLE:
+        if (pressed)
+        {
+            layer_set(layer, !(layer_mask & (1UL << layer)));
+        }
+        break;
+    case LAYER_ONESHOT:
+        if (pressed)
+        {
+            if (oneshot_layer >= 0)
+            {
+                oneshot_end();
+            }
+            oneshot_layer = layer;
+            oneshot_held = true;
+            oneshot_used = false;
+            layer_set(layer, true);
+        }
+        else if (oneshot_layer == layer)
+        {
+            oneshot_held = false;
+            // used as a momentary layer, otherwise it waits for the next key
+            if (oneshot_used)
+            {
+                oneshot_end();
+            }
+        }
+        break;
+    case LAYER_DEFAULT:
+        if (pressed && layer != layer_default)
+        {
+            layer_default = layer;
+            layer_resolve();
+        }
+        break;
+    }
+}
+
+action_t layer_apply(uint8_t key, bool pressed)
+{
+    action_t action;
+    if (pressed)
+    {
+        action = layer_pressed[key] = layer_resolved[key];
+    }
+    else
+    {
+        action = layer_pressed[key];
+        layer_pressed[key] = KC_NO;
+    }
+
+    // a one-shot layer ends with the first key pressed on it
+    if (pressed && action != KC_NO && ACTION_KIND(action) != ACTION_LAYER && oneshot_layer >= 0)
+    {
+        if (oneshot_held)
+        {
+            oneshot_used = true;
+        }
+        else
+        {
+            oneshot_end();
+        }
+    }
+    return action;
+}
@@ -0,0 +1,44 @@
+#ifndef _LAYER_H_
+#define _LAYER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "input_matrix.h"
+#include "action.h"
+
+/** @brief Maximum number of layers, one bit each in the layer mask. */
+#define LAYER_MAX 32
+
+/** @brief Layer operations of ACTION_LAYER actions, the layer is the low byte.
+ *
+ * MO: active while held. TG: toggled on press. OSL: active for the next key press,
+ * or like MO if other keys are pressed while it is held. DF: becomes the default layer. */
+enum layer_op
+{
+    LAYER_MOMENTARY,
+    LAYER_TOGGLE,
+    LAYER_ONESHOT,
+    LAYER_DEFAULT,
+};
+#define MO(layer) ACTION(ACTION_LAYER, LAYER_MOMENTARY << 8 | (layer))
+#define TG(layer) ACTION(ACTION_LAYER, LAYER_TOGGLE << 8 | (layer))
+#define OSL(layer) ACTION(ACTION_LAYER, LAYER_ONESHOT << 8 | (layer))
+#define DF(layer) ACTION(ACTION_LAYER, LAYER_DEFAULT << 8 | (layer))
+
+/** @brief Set the keymap, keymap[layer][key] for key indices from MATRIX_KEY(). Layer 0 is the default layer. */
+void layer_init(const action_t *const *keymap, int nlayers);
+
+/** @brief Resolve a key event through the active layers.
+ *
+ * The effective action of every key is cached and only recomputed when the active layers
+ * change, so a lookup is one array index. A release always resolves to the action of
+ * the press, even if the layers changed in between.
+ *
+ * @return action to apply, KC_NO for unmapped keys */
+action_t layer_apply(uint8_t key, bool pressed);
+
+/** @brief Handle the press or release of an ACTION_LAYER action. */
+void layer_action(action_t action, bool pressed);
+
+#endif
@@ -0,0 +1,31 @@
+#include "esp_log.h"
+
+#include "layout.h"
+
+#define LAYOUT_TAG "layout"
+
+static const layout_char_t *const *layout_pages = NULL;
+
+void layout_select(uint8_t layout)
+{
+    if (layout >= LAYOUT_MAX)
+    {
+        ESP_LOGW(LAYOUT_TAG, "no layout %d, using US", layout);
+        layout = LAYOUT_US;
+    }
+    layout_pages = layout_tables[layout];
+}
+
+const layout_char_t *layout_lookup(uint32_t code_point)
+{
+    if (layout_pages == NULL)
+    {
+        layout_pages = layout_tables[LAYOUT_US];
+    }
+    if (code_point >= LAYOUT_PAGES * 256 || layout_pages[code_point >> 8] == NULL)
+    {
+        return NULL;
+    }
+    const layout_char_t *c = &layout_pages[code_point >> 8][code_point & 0xff];
+    return c->strokes[0].keycode != KC_NO ? c : NULL;
+}
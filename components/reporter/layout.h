@@ -0,0 +1,45 @@
+#ifndef _LAYOUT_H_
+#define _LAYOUT_H_
+
+#include <stdint.h>
+
+#include "reporter.h"
+#include "macro.h"
+
+/** @brief Host keyboard layouts, the value is config_data_t.locale and stored in NVS, so only append.
+ *
+ * Each one has a definition in layouts/, the tables are generated from them at build time. */
+typedef enum
+{
+    LAYOUT_US,
+    LAYOUT_DE,
+    LAYOUT_FR,
+    LAYOUT_JIS,
+    LAYOUT_MAX,
+} layout_id_t;
+
+/** @brief Keystrokes per character, a dead key and the key after it. */
+#define LAYOUT_STROKES 2
+/** @brief Pages of 256 code points, the tables cover the basic multilingual plane. */
+#define LAYOUT_PAGES 256
+
+/** @brief Keystrokes that type a character, strokes[0].keycode is KC_NO if the layout has none.
+ *
+ * A single keystroke leaves strokes[1] {0, KC_NO}. */
+typedef struct
+{
+    macro_report_t strokes[LAYOUT_STROKES];
+} layout_char_t;
+
+/** @brief Character tables by layout and page, NULL for pages without any character (layout_tables.c). */
+extern const layout_char_t *const *const layout_tables[LAYOUT_MAX];
+
+/** @brief Select the layout of the host, out of range values select LAYOUT_US. */
+void layout_select(uint8_t layout);
+
+/** @brief Keystrokes of a Unicode code point on the selected layout.
+ *
+ * Two table accesses, no search. @return NULL if the layout can't type it */
+const layout_char_t *layout_lookup(uint32_t code_point);
+
+#endif
@@ -0,0 +1,111 @@
+#!/usr/bin/env python3
+"""Generate the character tables of layout.c from the layout definitions.
+
+usage: gen_layouts.py <output.c> <layout>.layout...
+
+The layouts are given in layout_id_t order, <layout> names the enum entry
+(us.layout is LAYOUT_US). Every line of a definition maps one character:
+
+    <character> <keystroke> [<keystroke>]
+
+character   the character itself, or U+XXXX (needed for space, tab, newline and '#')
+keystroke   KEY or modifier+...+KEY, KEY is the keycode without KC_ (reporter.h),
+            modifiers are shift, ctrl, alt and altgr (the right alt)
+
+A second keystroke follows a dead key, e.g. "â GRAVE A" on the German layout.
+Lines starting with '#' are comments.
+
+The output has a table of 256 characters for every 256 code point page
+a layout uses and a page index per layout, so looking up a character is
+two array accesses.
+"""
+
+import os
+import sys
+
+MODIFIERS = {
+    "ctrl": "LEFT_CONTROL_KEY_MASK",
+    "shift": "LEFT_SHIFT_KEY_MASK",
+    "alt": "LEFT_ALT_KEY_MASK",
+    "altgr": "RIGHT_ALT_KEY_MASK",
+}
+STROKES = 2  # LAYOUT_STROKES in layout.h
+PAGES = 256  # LAYOUT_PAGES in layout.h
+
+
+def parse_character(token):
+    if token.startswith("U+") and len(token) > 2:
+        return int(token[2:], 16)
+    if len(token) != 1:
+        raise ValueError("'%s' is not a single character, use U+XXXX" % token)
+    return ord(token)
+
+
+def parse_keystroke(token):
+    *mods, key = token.split("+")
+    for mod in mods:
+        if mod not in MODIFIERS:
+            raise ValueError("unknown modifier '%s'" % mod)
+    modifier = " | ".join(MODIFIERS[mod] for mod in mods) or "0"
+    return "{%s, KC_%s}" % (modifier, key)
+
+
+def parse_layout(path):
+    chars = {}
+    with open(path, encoding="utf-8") as f:
+        for number, line in enumerate(f, 1):
+            tokens = line.split()
+            if not tokens or tokens[0].startswith("#"):
+                continue
+            try:
+                if not 2 <= len(tokens) <= STROKES + 1:
+                    raise ValueError("expected a character and 1 to %d keystrokes" % STROKES)
+                code_point = parse_character(tokens[0])
+                if code_point >= PAGES * 256:
+                    raise ValueError("U+%04X is outside of the basic multilingual plane" % code_point)
+                if code_point in chars:
+                    raise ValueError("U+%04X is defined twice" % code_point)
+                chars[code_point] = [parse_keystroke(t) for t in tokens[1:]]
+            except ValueError as e:
+                sys.exit("%s:%d: %s" % (path, number, e))
+    return chars
+
+
+def main():
+    if len(sys.argv) < 3:
+        sys.exit(__doc__)
+    out = [
+        "/* Generated by layouts/gen_layouts.py from the layout definitions, do not edit. */",
+        "#include \"esp_hidd_prf_api.h\"",
+        "",
+        "#include \"layout.h\"",
+        "",
+    ]
+    ids = []
+    for path in sys.argv[2:]:
+        name = os.path.splitext(os.path.basename(path))[0].lower()
+        chars = parse_layout(path)
+        pages = sorted({cp >> 8 for cp in chars})
+        for page in pages:
+            out.append("static const layout_char_t layout_%s_%02x[256] = {" % (name, page))
+            for cp in sorted(c for c in chars if c >> 8 == page):
+                out.append("    [0x%02x] = {{%s}}, // U+%04X" % (cp & 0xff, ", ".join(chars[cp]), cp))
+            out.append("};")
+        out.append("static const layout_char_t *const layout_%s[LAYOUT_PAGES] = {" % name)
+        for page in pages:
+            out.append("    [0x%02x] = layout_%s_%02x," % (page, name, page))
+        out.append("};")
+        out.append("")
+        ids.append(name)
+    out.append("const layout_char_t *const *const layout_tables[LAYOUT_MAX] = {")
+    for name in ids:
+        out.append("    [LAYOUT_%s] = layout_%s," % (name.upper(), name))
+    out.append("};")
+    out.append("_Static_assert(LAYOUT_MAX == %d, \"every layout_id_t needs a definition in layouts/\");" % len(ids))
+
+    with open(sys.argv[1], "w", encoding="utf-8") as f:
+        f.write("\n".join(out) + "\n")
+
+
+if __name__ == "__main__":
+    main()
@@ -0,0 +1,194 @@
+#include "esp_log.h"
+
+#include "macro.h"
+#include "layout.h"
+
+#define MACRO_TAG "macro"
+
+static const macro_t *macro_table;
+static int macro_count;
+static macro_send_t macro_send;
+
+static bool running;
+// report sequence of the running macro and its next report, or the text it types
+static const macro_report_t *reports;
+static uint16_t nreports;
+static uint16_t position;
+static const char *text;
+// reports of the character being typed, a release or modifier change before every keystroke at most and one at the end
+static macro_report_t text_reports[2 * LAYOUT_STROKES + 1];
+static int text_count;
+static int text_position;
+static uint8_t text_keycode; // key of the last report, KC_NO after a release
+static uint8_t text_modifier; // modifiers of the last report
+
+void macro_init(const macro_t *macros, int nmacros, macro_send_t send)
+{
+    if (nmacros > MACRO_MAX)
+    {
+        ESP_LOGE(MACRO_TAG, "%d macros, only the first %d are used", nmacros, MACRO_MAX);
+        nmacros = MACRO_MAX;
+    }
+    macro_table = macros;
+    macro_count = nmacros;
+    macro_send = send;
+    running = false;
+}
+
+static bool macro_begin(const macro_t *macro)
+{
+    if (running)
+    {
+        return false;
+    }
+    reports = macro->reports;
+    nreports = macro->nreports;
+    position = 0;
+    text = macro->text;
+    text_count = 0;
+    text_position = 0;
+    text_keycode = KC_NO;
+    text_modifier = 0;
+    running = text != NULL ? *text != '\0' : nreports > 0;
+    return true;
+}
+
+void macro_start(uint16_t index)
+{
+    if (index >= macro_count)
+    {
+        ESP_LOGW(MACRO_TAG, "no macro %d", index);
+        return;
+    }
+    if (!macro_begin(&macro_table[index]))
+    {
+        ESP_LOGW(MACRO_TAG, "macro %d dropped, another one is running", index);
+    }
+}
+
+bool macro_type(const char *string)
+{
+    const macro_t macro = MACRO_TEXT(string);
+    return macro_begin(&macro);
+}
+
+void macro_stop()
+{
+    running = false;
+}
+
+bool macro_running()
+{
+    return running;
+}
+
+/** @brief Decode the UTF-8 sequence at text and move past it, invalid bytes decode to U+FFFD. */
+static uint32_t text_decode()
+{
+    const uint8_t *s = (const uint8_t *)text;
+    int length = s[0] < 0x80 ? 1 : s[0] < 0xc0 ? 0 : s[0] < 0xe0 ? 2 : s[0] < 0xf0 ? 3 : s[0] < 0xf8 ? 4 : 0;
+    uint32_t code_point = length == 1 ? s[0] : s[0] & (0x7f >> length);
+    for (int i = 1; i < length; i++)
+    {
+        if ((s[i] & 0xc0) != 0x80)
+        {
+            length = 0;
+            break;
+        }
+        code_point = code_point << 6 | (s[i] & 0x3f);
+    }
+    if (length == 0)
+    {
+        text++;
+        return 0xfffd;
+    }
+    text += length;
+    return code_point;
+}
+
+static void text_add(uint8_t modifier, uint8_t keycode)
+{
+    text_reports[text_count++] = (macro_report_t){modifier, keycode};
+    text_keycode = keycode;
+    text_modifier = modifier;
+}
+
+/** @brief Look up the keystrokes of the next character that the layout can type.
+ *
+ * Keystrokes follow each other without a release in between, unless they repeat
+ * the key, come after a dead key or change the modifiers, so most characters take a single report.
+ * A modifier change goes out without a key, a host may apply the modifiers of a report after its keys.
+ * @return false at the end of the text, after the final release */
+static bool text_encode()
+{
+    text_count = 0;
+    text_position = 0;
+    while (*text != '\0')
+    {
+        uint32_t code_point = text_decode();
+        const layout_char_t *c = layout_lookup(code_point);
+        if (c == NULL)
+        {
+            ESP_LOGW(MACRO_TAG, "U+%04X has no key on the host layout, skipped", code_point);
+            continue;
+        }
+        for (int i = 0; i < LAYOUT_STROKES && c->strokes[i].keycode != KC_NO; i++)
+        {
+            uint8_t modifier = c->strokes[i].modifier;
+            if (i > 0 || c->strokes[i].keycode == text_keycode || modifier != text_modifier)
+            {
+                text_add(modifier, KC_NO);
+            }
+            text_add(modifier, c->strokes[i].keycode);
+        }
+        return true;
+    }
+    if (text_keycode != KC_NO || text_modifier != 0)
+    {
+        text_add(0, KC_NO);
+        return true;
+    }
+    return false;
+}
+
+/** @brief Next report of the running macro, NULL once it has none left. */
+static const macro_report_t *macro_next()
+{
+    if (text == NULL)
+    {
+        return position < nreports ? &reports[position] : NULL;
+    }
+    if (text_position == text_count && !text_encode())
+    {
+        return NULL;
+    }
+    return &text_reports[text_position];
+}
+
+void macro_run()
+{
+    // no timer in between: the link's confirmations pace the reports
+    while (running)
+    {
+        const macro_report_t *report = macro_next();
+        if (report == NULL)
+        {
+            running = false;
+        }
+        else if (macro_send(report))
+        {
+            if (text == NULL)
+            {
+                position++;
+            }
+            else
+            {
+                text_position++;
+            }
+        }
+        else
+        {
+            break;
+        }
+    }
+}
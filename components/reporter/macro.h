@@ -0,0 +1,68 @@
+#ifndef _MACRO_H_
+#define _MACRO_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "action.h"
+
+/** @brief Maximum number of macros in a table, the index has to fit into the 12 bit action argument. */
+#define MACRO_MAX 4096
+
+/** @brief One keyboard report of a macro: the modifier byte (KeyboardModifier) and at most one key.
+ *
+ * A report replaces the one before it, so {0, 0} releases everything. */
+typedef struct
+{
+    uint8_t modifier;
+    uint8_t keycode;
+} macro_report_t;
+
+/** @brief Report sequence or text, keep both const so they stay in flash. */
+typedef struct
+{
+    const macro_report_t *reports;
+    uint16_t nreports;
+    const char *text; // UTF-8, typed with the keystrokes of the host layout (layout.h) instead of reports
+} macro_t;
+
+/** @brief Tap a key with the modifiers held, e.g.
+ * static const macro_report_t hi[] = {MACRO_TAP(LEFT_SHIFT_KEY_MASK, KC_H), MACRO_TAP(0, KC_I)};
+ *
+ * The release report between two taps is only needed if they repeat the key,
+ * leave it out with {modifier, keycode} entries otherwise to halve the reports. */
+#define MACRO_TAP(modifier, keycode) {(modifier), (keycode)}, {0, 0}
+/** @brief macro_t of a macro_report_t array. */
+#define MACRO_REPORTS(reports) {(reports), sizeof(reports) / sizeof((reports)[0]), NULL}
+/** @brief macro_t of a string, e.g. MACRO_TEXT("Grüße\n"). */
+#define MACRO_TEXT(string) {NULL, 0, (string)}
+/** @brief Keymap action that types macro index of the table given to macro_init(). */
+#define MACRO(index) ACTION(ACTION_MACRO, index)
+
+/** @brief Hands a report of the running macro to the link.
+ *
+ * @return false if the link can't take it now, the report is offered again by the next macro_run() */
+typedef bool (*macro_send_t)(const macro_report_t *report);
+
+void macro_init(const macro_t *macros, int nmacros, macro_send_t send);
+
+/** @brief Start streaming a macro, a macro started while another one runs is dropped. */
+void macro_start(uint16_t index);
+
+/** @brief Type a UTF-8 string like a text macro, it has to stay valid until the macro ended.
+ *
+ * @return false if another macro is running */
+bool macro_type(const char *text);
+
+/** @brief Stop the running macro, e.g. when the connection is gone. */
+void macro_stop();
+
+/** @brief True while a macro has reports left, the keyboard report belongs to the macro then. */
+bool macro_running();
+
+/** @brief Send reports of the running macro until the link refuses one or the macro ends.
+ *
+ * Call again whenever the link can take more, e.g. after a notification was confirmed. */
+void macro_run();
+
+#endif
@@ -0,0 +1,118 @@
+#include <string.h>
+
+#include "report_builder.h"
+
+_Static_assert(sizeof(KeyboardModifier) == 1, "the modifier is the first byte of the boot report");
+
+/** @brief Modifier bit of every keycode, 0 for keys that are not modifiers. */
+static const uint8_t report_modifier[256] = {
+    [KC_LCTRL] = 0x01,
+    [KC_LSHIFT] = 0x02,
+    [KC_LALT] = 0x04,
+    [KC_LGUI] = 0x08,
+    [KC_RCTRL] = 0x10,
+    [KC_RSHIFT] = 0x20,
+    [KC_RALT] = 0x40,
+    [KC_RGUI] = 0x80,
+};
+
+void report_init(keyboard_report_t *report)
+{
+    memset(report, 0, sizeof(*report));
+}
+
+static void report_bitmap_set(keyboard_report_t *report, uint8_t keycode, bool pressed)
+{
+    if (keycode < REPORT_NKRO_FIRST || keycode > REPORT_NKRO_LAST)
+    {
+        return;
+    }
+    uint8_t bit = keycode - REPORT_NKRO_FIRST;
+    if (pressed)
+    {
+        report->bitmap[bit / 8] |= 1 << (bit % 8);
+    }
+    else
+    {
+        report->bitmap[bit / 8] &= ~(1 << (bit % 8));
+    }
+}
+
+/** @brief Copy the six most recently pressed keycodes into keys.
+ *
+ * @return true if the boot report changed */
+static bool report_boot_keys(keyboard_report_t *report)
+{
+    // walk back from the newest key, then copy forward so the keys stay in press order
+    uint8_t keycode = KC_NO;
+    int n = 0;
+    while (n < REPORT_KEYS && report->older[keycode] != KC_NO)
+    {
+        keycode = report->older[keycode];
+        n++;
+    }
+    uint8_t keys[REPORT_KEYS] = {KC_NO};
+    for (int i = 0; i < n; i++)
+    {
+        keys[i] = keycode;
+        keycode = report->newer[keycode];
+    }
+    if (n == report->nkeys && memcmp(keys, report->keys, REPORT_KEYS) == 0)
+    {
+        return false;
+    }
+    memcpy(report->keys, keys, REPORT_KEYS);
+    report->nkeys = n;
+    return true;
+}
+
+static uint8_t report_press(keyboard_report_t *report, uint8_t keycode)
+{
+    // a second key with the same keycode does not change the report
+    if (report->held[keycode]++)
+    {
+        return 0;
+    }
+    report_bitmap_set(report, keycode, true);
+    uint8_t modifier = report_modifier[keycode];
+    if (modifier)
+    {
+        report->modifier.Value |= modifier;
+        return REPORT_CHANGED_NKRO | REPORT_CHANGED_BOOT;
+    }
+    // append as the newest key
+    uint8_t newest = report->older[KC_NO];
+    report->newer[keycode] = KC_NO;
+    report->older[keycode] = newest;
+    report->newer[newest] = keycode;
+    report->older[KC_NO] = keycode;
+    return REPORT_CHANGED_NKRO | (report_boot_keys(report) ? REPORT_CHANGED_BOOT : 0);
+}
+
+static uint8_t report_release(keyboard_report_t *report, uint8_t keycode)
+{
+    if (report->held[keycode] == 0 || --report->held[keycode])
+    {
+        return 0;
+    }
+    report_bitmap_set(report, keycode, false);
+    uint8_t modifier = report_modifier[keycode];
+    if (modifier)
+    {
+        report->modifier.Value &= ~modifier;
+        return REPORT_CHANGED_NKRO | REPORT_CHANGED_BOOT;
+    }
+    // unlink, a key rolled out of the boot report moves back in when a newer one is released
+    report->newer[report->older[keycode]] = report->newer[keycode];
+    report->older[report->newer[keycode]] = report->older[keycode];
+    return REPORT_CHANGED_NKRO | (report_boot_keys(report) ? REPORT_CHANGED_BOOT : 0);
+}
+
+uint8_t report_apply(keyboard_report_t *report, uint8_t keycode, bool pressed)
+{
+    if (keycode == KC_NO)
+    {
+        return 0;
+    }
+    return pressed ? report_press(report, keycode) : report_release(report, keycode);
+}
@@ -0,0 +1,56 @@
+#ifndef _REPORT_BUILDER_H_
+#define _REPORT_BUILDER_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "reporter.h"
+
+/** @brief Number of keycodes in the 6KRO (boot protocol) keyboard report. */
+#define REPORT_KEYS 6
+/** @brief Keycodes covered by the NKRO bitmap, KC_A (0x04) up to and including the modifiers. */
+#define REPORT_NKRO_FIRST KC_A
+#define REPORT_NKRO_LAST KC_RGUI
+/** @brief Size of the NKRO bitmap, bit n is keycode REPORT_NKRO_FIRST + n. */
+#define REPORT_NKRO_BYTES ((REPORT_NKRO_LAST - REPORT_NKRO_FIRST + 1 + 7) / 8)
+/** @brief Size of the boot protocol report: modifier byte, reserved byte and the keys. */
+#define REPORT_BOOT_BYTES (2 + REPORT_KEYS)
+
+/** @brief report_apply() result, which of the two report formats changed and has to be sent. */
+#define REPORT_CHANGED_NKRO 0x01
+#define REPORT_CHANGED_BOOT 0x02
+
+/** @brief Keyboard input reports, kept up to date by applying every key event to them.
+ *
+ * Both formats are maintained side by side: the NKRO bitmap for report protocol mode,
+ * and the modifier byte plus the six most recently pressed keys for boot protocol mode.
+ * The lookup tables are indexed by keycode, so a press or release costs the same
+ * no matter how many keys the matrix has or how many are held. Both formats are
+ * laid out as they are sent, so the reports go to the link without being copied first. */
+typedef struct
+{
+    union
+    {
+        uint8_t boot[REPORT_BOOT_BYTES]; // the boot protocol report as sent
+        struct
+        {
+            KeyboardModifier modifier;
+            uint8_t reserved;
+            uint8_t keys[REPORT_KEYS]; // six most recently pressed keycodes, oldest first, packed at the front
+        };
+    };
+    uint8_t nkeys;
+    uint8_t bitmap[REPORT_NKRO_BYTES];
+    uint8_t held[256];         // number of pressed keys mapped to each keycode
+    uint8_t newer[256];        // press order of the held non-modifier keycodes, a doubly linked
+    uint8_t older[256];        // ring through KC_NO: newer[KC_NO] is the oldest, older[KC_NO] the newest
+} keyboard_report_t;
+
+void report_init(keyboard_report_t *report);
+
+/** @brief Apply the press or release of a key mapped to keycode.
+ *
+ * @return REPORT_CHANGED_* bits of the reports that changed, 0 if nothing has to be sent */
+uint8_t report_apply(keyboard_report_t *report, uint8_t keycode, bool pressed);
+
+#endif
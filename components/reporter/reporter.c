@@ -43,6 +43,7 @@
 #include "esp_wifi.h"
 #include "esp_event.h"
 #include "esp_log.h"
+#include "esp_timer.h"
 #include "nvs_flash.h"
 #include "esp_bt.h"
 
@@ -59,6 +60,16 @@
 #include "config.h"
 
 #include "input_matrix.h"
+#include "key_event.h"
+#include "action.h"
+#include "combo.h"
+#include "conn_params.h"
+#include "host.h"
+#include "layer.h"
+#include "layout.h"
+#include "macro.h"
+#include "report_builder.h"
+#include "tap_hold.h"
 #include "reporter.h"
 /**
  * Brief:
@@ -98,6 +109,7 @@
 
 static uint16_t hid_conn_id = 0;
 static bool sec_conn = false;
+static TaskHandle_t reporter_task;
 
 static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *param);
 
@@ -255,14 +267,45 @@ static void hidd_event_callback(esp_hidd_cb_event_t event, esp_hidd_cb_param_t *
         ESP_LOGI(HID_DEMO_TAG, "ESP_HIDD_EVENT_BLE_CONNECT");
         hid_conn_id = param->connect.conn_id;
         xEventGroupClearBits(eventgroup_system, SYSTEM_CURRENTLY_ADVERTISING);
+        host_link_up(param->connect.remote_bda);
+        if (reporter_task != NULL)
+        {
+            xTaskNotifyGive(reporter_task);
+        }
         break;
     }
     case ESP_HIDD_EVENT_BLE_DISCONNECT:
     {
-        sec_conn = false;
         ESP_LOGI(HID_DEMO_TAG, "ESP_HIDD_EVENT_BLE_DISCONNECT");
-        esp_ble_gap_start_advertising(&hidd_adv_params);
-        xEventGroupSetBits(eventgroup_system, SYSTEM_CURRENTLY_ADVERTISING);
+        if (param->disconnect.conn_id != hid_conn_id)
+        {
+            break;
+        }
+        sec_conn = false;
+        conn_params_disconnected();
+        // the report task advertises again, to the host of the selected profile
+        host_link_down();
+        if (reporter_task != NULL)
+        {
+            xTaskNotifyGive(reporter_task);
+        }
+        break;
+    }
+    case ESP_HIDD_EVENT_BLE_CONF:
+    {
+        // the report task flushes the queued reports and runs the macro as soon as there is room
+        if (reporter_task != NULL)
+        {
+            xTaskNotifyGive(reporter_task);
+        }
+        break;
+    }
+    case ESP_HIDD_EVENT_BLE_CONGEST:
+    {
+        if (!param->congest.congested && reporter_task != NULL)
+        {
+            xTaskNotifyGive(reporter_task);
+        }
         break;
     }
     case ESP_HIDD_EVENT_BLE_VENDOR_REPORT_WRITE_EVT:
@@ -285,8 +328,26 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
     switch (event)
     {
     case ESP_GAP_BLE_ADV_DATA_SET_COMPLETE_EVT:
-        esp_ble_gap_start_advertising(&hidd_adv_params);
-        xEventGroupSetBits(eventgroup_system, SYSTEM_CURRENTLY_ADVERTISING);
+        // the report task starts advertising, directed to the host of the selected profile
+        host_adv_ready();
+        if (reporter_task != NULL)
+        {
+            xTaskNotifyGive(reporter_task);
+        }
+        break;
+    case ESP_GAP_BLE_ADV_START_COMPLETE_EVT:
+        if (param->adv_start_cmpl.status == ESP_BT_STATUS_SUCCESS)
+        {
+            xEventGroupSetBits(eventgroup_system, SYSTEM_CURRENTLY_ADVERTISING);
+        }
+        break;
+    case ESP_GAP_BLE_ADV_STOP_COMPLETE_EVT:
+        xEventGroupClearBits(eventgroup_system, SYSTEM_CURRENTLY_ADVERTISING);
+        host_adv_stopped();
+        if (reporter_task != NULL)
+        {
+            xTaskNotifyGive(reporter_task);
+        }
         break;
     case ESP_GAP_BLE_SEC_REQ_EVT:
         for (int i = 0; i < ESP_BD_ADDR_LEN; i++)
@@ -296,7 +357,7 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
         esp_ble_gap_security_rsp(param->ble_security.ble_req.bd_addr, true);
         break;
     case ESP_GAP_BLE_AUTH_CMPL_EVT:
-        sec_conn = true;
+    {
         esp_bd_addr_t bd_addr;
         memcpy(bd_addr, param->ble_security.auth_cmpl.bd_addr, sizeof(esp_bd_addr_t));
         ESP_LOGI(HID_DEMO_TAG, "remote BD_ADDR: %08x%04x",
@@ -308,9 +369,16 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
         {
             ESP_LOGE(HID_DEMO_TAG, "fail reason = 0x%x", param->ble_security.auth_cmpl.fail_reason);
         }
-        else
+        else if (host_connected(bd_addr, param->ble_security.auth_cmpl.addr_type))
         {
+            sec_conn = true;
             xEventGroupClearBits(eventgroup_system, SYSTEM_CURRENTLY_ADVERTISING);
+            // connection parameter updates are only accepted once the link is encrypted
+            conn_params_connected(bd_addr);
+            if (reporter_task != NULL)
+            {
+                xTaskNotifyGive(reporter_task);
+            }
         }
 #if CONFIG_MODULE_BT_PAIRING
         //add connected device to whitelist (necessary if whitelist connections only).
@@ -328,6 +396,16 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
         }
 #endif
         break;
+    }
+    case ESP_GAP_BLE_UPDATE_CONN_PARAMS_EVT:
+        conn_params_updated(param->update_conn_params.status == ESP_BT_STATUS_SUCCESS,
+                            param->update_conn_params.conn_int, param->update_conn_params.latency,
+                            param->update_conn_params.timeout);
+        if (reporter_task != NULL)
+        {
+            xTaskNotifyGive(reporter_task);
+        }
+        break;
     default:
         break;
     }
@@ -336,89 +414,305 @@ static void gap_event_handler(esp_gap_ble_cb_event_t event, esp_ble_gap_cb_param
 #define CHAR(x) (x - 'a' + 4)
 #define NUMB(x) (x - '1' + 0x1E)
 
+#define _______ KC_TRANSPARENT
+
+/* Keymap layers, see action.h for the actions and layer.h for the layer keys. */
 #if LEFT
-uint8_t input_map[] = {
+static const action_t layer_base[] = {
     KC_ESCAPE, KC_1, KC_2, KC_3, KC_4, KC_5,
     KC_GRAVE, KC_Q, KC_W, KC_E, KC_R, KC_T,
     KC_TAB, KC_A, KC_S, KC_D, KC_F, KC_G,
     KC_LSHIFT, KC_Z, KC_X, KC_C, KC_V, KC_B,
-    KC_NO, KC_NO, KC_TAB, KC_BSLASH, KC_DELETE, KC_LSHIFT,
+    MO(1), KC_NO, KC_TAB, KC_BSLASH, KC_DELETE, KC_LSHIFT,
     KC_NO, KC_NO, KC_ENTER, KC_LALT, KC_SPACE, KC_LCTRL};
+static const action_t layer_fn[] = {
+    _______, KC_F1, KC_F2, KC_F3, KC_F4, KC_F5,
+    _______, _______, _______, _______, _______, _______,
+    _______, _______, _______, _______, _______, _______,
+    _______, _______, _______, _______, _______, _______,
+    _______, _______, _______, _______, _______, _______,
+    _______, _______, _______, _______, _______, _______};
 #else
-uint8_t input_map[] = {
+static const action_t layer_base[] = {
     KC_6, KC_7, KC_8, KC_9, KC_0, KC_MINUS,
     KC_Y, KC_U, KC_I, KC_O, KC_P, KC_EQUAL,
     KC_H, KC_J, KC_K, KC_L, KC_SCOLON, KC_QUOTE,
     KC_N, KC_M, KC_COMMA, KC_DOT, KC_SLASH, KC_RSHIFT,
-    KC_SPACE, KC_BSPACE, KC_LBRACKET, KC_RBRACKET, KC_NO, KC_NO,
+    KC_SPACE, KC_BSPACE, KC_LBRACKET, KC_RBRACKET, MO(1), KC_NO,
     KC_RCTRL, KC_RALT, KC_RGUI, KC_PGDOWN, KC_NO, KC_NO};
+static const action_t layer_fn[] = {
+    KC_F6, KC_F7, KC_F8, KC_F9, KC_F10, KC_F11,
+    _______, _______, _______, _______, _______, KC_F12,
+    KC_LEFT, KC_DOWN, KC_UP, KC_RIGHT, _______, _______,
+    _______, _______, _______, _______, _______, _______,
+    _______, _______, _______, _______, _______, _______,
+    _______, _______, _______, _______, _______, _______};
 #endif
+_Static_assert(sizeof(layer_base) == NBUTTON * sizeof(action_t), "layer_base does not match the board's matrix size");
+_Static_assert(sizeof(layer_fn) == NBUTTON * sizeof(action_t), "layer_fn does not match the board's matrix size");
 
-uint8_t prev_kbdcmd[] = {0, 0, 0, 0, 0, 0};
-KeyboardModifier prev_modifier = {0};
-void input_test(void *pvParameters)
+/** @brief keymap[layer][key], layer 0 is the default layer. */
+static const action_t *const keymap[] = {layer_base, layer_fn};
+_Static_assert(sizeof(keymap) / sizeof(keymap[0]) <= LAYER_MAX, "more layers than bits in the layer mask");
+
+/** @brief Combos, e.g. {2, {MATRIX_KEY(2, 1), MATRIX_KEY(2, 2)}, KC_ESCAPE}.
+ *
+ * Only the keys of a combo wait for the other keys, up to the combo's term. */
+static const combo_t combos[] = {};
+
+/** @brief Macros, e.g. MACRO_REPORTS(hi) of a macro_report_t array or MACRO_TEXT("Grüße"), typed by MACRO(index) keys. */
+static const macro_t macros[] = {};
+_Static_assert(REPORT_NKRO_BYTES == HID_NKRO_IN_RPT_LEN, "the NKRO bitmap does not match the report descriptor");
+_Static_assert(REPORT_BOOT_BYTES == HID_KEYBOARD_IN_RPT_LEN, "the boot report does not match the report descriptor");
+
+static action_state_t state;
+static bool nkro = false;
+static macro_report_t macro_sent; // the last macro report the host got
+
+/** @brief Send the reports that changed since the last call.
+ *
+ * A report refused by a full queue stays marked as changed, the current state goes out
+ * after the next confirmation woke the task. */
+static void send_reports()
 {
-    uint8_t ndown = 0;
-    uint8_t kbdcmd[] = {0, 0, 0, 0, 0, 0};
-    KeyboardModifier modifier = {0};
-    while (true)
+    static const uint8_t released[REPORT_NKRO_BYTES] = {0};
+    keyboard_report_t *report = &state.keyboard;
+    if (!sec_conn)
+    {
+        state.keyboard_changed = 0;
+        state.consumer_changed = false;
+        macro_stop();
+        macro_sent = (macro_report_t){0, KC_NO};
+        return;
+    }
+    if (state.consumer_changed)
+    {
+        state.consumer_changed = !esp_hidd_send_consumer_value(hid_conn_id, state.consumer, state.consumer != 0);
+    }
+    // the keyboard report belongs to a running macro, the held keys go out once it is done
+    if (!state.keyboard_changed || macro_running())
+    {
+        return;
+    }
+    uint8_t changed = state.keyboard_changed;
+    state.keyboard_changed = 0;
+
+    // NKRO in report protocol mode, the six most recent keys in boot protocol mode
+    // or while the MTU is too small for the bitmap
+    bool use_nkro = esp_hidd_nkro_available(hid_conn_id);
+    if (use_nkro != nkro)
+    {
+        // release everything in the report that is not used any more, or the host keeps the keys held
+        if (!(nkro ? esp_hidd_send_nkro_value(hid_conn_id, released)
+                   : esp_hidd_send_keyboard_report(hid_conn_id, released)))
+        {
+            state.keyboard_changed |= changed;
+            return;
+        }
+        nkro = use_nkro;
+        changed = REPORT_CHANGED_NKRO | REPORT_CHANGED_BOOT;
+    }
+    if (nkro && (changed & REPORT_CHANGED_NKRO))
+    {
+        if (!esp_hidd_send_nkro_value(hid_conn_id, report->bitmap))
+        {
+            state.keyboard_changed |= changed;
+        }
+    }
+    else if (!nkro && (changed & REPORT_CHANGED_BOOT))
     {
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        if (!esp_hidd_send_keyboard_report(hid_conn_id, report->boot))
+        {
+            state.keyboard_changed |= changed;
+        }
+    }
+}
 
-        if (sec_conn == false)
+/** @brief Send a macro report in the current format, if it goes to the stack right away.
+ *
+ * Queueing them instead would let the queue coalesce or replace macro reports. */
+static bool send_macro_report(const macro_report_t *report)
+{
+    // hosts take the NKRO bitmap in usage order, the modifiers after the keys: a key released
+    // before its modifiers are dropped and the modifiers of a new key pressed first go out on their own
+    for (;;)
+    {
+        if (!sec_conn || !esp_hidd_send_ready(hid_conn_id))
+        {
+            return false;
+        }
+        macro_report_t step = *report;
+        if (nkro && macro_sent.keycode != KC_NO && macro_sent.keycode != report->keycode &&
+            (macro_sent.modifier & ~report->modifier))
+        {
+            step = (macro_report_t){macro_sent.modifier, KC_NO};
+        }
+        else if (nkro && report->keycode != KC_NO && report->keycode != macro_sent.keycode &&
+                 report->modifier != macro_sent.modifier)
+        {
+            step = (macro_report_t){report->modifier, KC_NO};
+        }
+        if (nkro)
+        {
+            uint8_t bitmap[REPORT_NKRO_BYTES] = {0};
+            if (step.keycode >= REPORT_NKRO_FIRST && step.keycode <= REPORT_NKRO_LAST)
+            {
+                bitmap[(step.keycode - REPORT_NKRO_FIRST) / 8] |= 1 << ((step.keycode - REPORT_NKRO_FIRST) % 8);
+            }
+            for (uint8_t mods = step.modifier; mods; mods &= mods - 1)
+            {
+                uint8_t modifier = KC_LCTRL + __builtin_ctz(mods) - REPORT_NKRO_FIRST;
+                bitmap[modifier / 8] |= 1 << (modifier % 8);
+            }
+            esp_hidd_send_nkro_value(hid_conn_id, bitmap);
+        }
+        else
+        {
+            uint8_t boot[REPORT_BOOT_BYTES] = {step.modifier, 0, step.keycode};
+            esp_hidd_send_keyboard_report(hid_conn_id, boot);
+        }
+        macro_sent = step;
+        if (step.modifier == report->modifier && step.keycode == report->keycode)
         {
-            continue;
+            return true;
         }
-        ndown = 0;
-        modifier.Value = 0;
-        memset(kbdcmd, 0, sizeof(kbdcmd));
-        for (int i = 0; i < NBUTTON; i++)
+    }
+}
+
+/** @brief Actions waiting for a report the queue refused, in the order they take effect.
+ *
+ * No key events are taken while it holds any, so only the events the tap-hold and
+ * combo engines hold back can follow the one that filled it. */
+#define ACTION_BACKLOG (2 * (TAP_HOLD_BUFFER + COMBO_MAX_KEYS + 1))
+static struct
+{
+    action_t action;
+    bool pressed;
+} backlog[ACTION_BACKLOG];
+static int backlog_head, backlog_count;
+
+/** @brief Apply the waiting actions until a release would take back a change the host
+ * has not got yet, e.g. a decided tap whose press the full queue refused. */
+static void apply_actions()
+{
+    while (backlog_count > 0)
+    {
+        action_t action = backlog[backlog_head].action;
+        bool pressed = backlog[backlog_head].pressed;
+        if (!pressed && (state.keyboard_changed || state.consumer_changed))
         {
-            if (input_buttons[i] == 1)
+            send_reports();
+            if (state.keyboard_changed || state.consumer_changed)
             {
-                switch (input_map[i])
-                {
-                case KC_LCTRL:
-                    modifier.LCTRL = true;
-                    break;
-                case KC_LSHIFT:
-                    modifier.LSHIFT = true;
-                    break;
-                case KC_LALT:
-                    modifier.LALT = true;
-                    break;
-                case KC_LGUI:
-                    modifier.LGUI = true;
-                    break;
-                case KC_RCTRL:
-                    modifier.RCTRL = true;
-                    break;
-                case KC_RSHIFT:
-                    modifier.RSHIFT = true;
-                    break;
-                case KC_RALT:
-                    modifier.RALT = true;
-                    break;
-                case KC_RGUI:
-                    modifier.RGUI = true;
-                    break;
-                default:
-                    kbdcmd[ndown] = input_map[i];
-                    ndown++;
-                }
+                return;
             }
         }
+        backlog_head = (backlog_head + 1) % ACTION_BACKLOG;
+        backlog_count--;
+        action_apply(&state, action, pressed);
+    }
+}
+
+static void emit_action(action_t action, bool pressed)
+{
+    if (backlog_count == ACTION_BACKLOG)
+    {
+        ESP_LOGW(HID_DEMO_TAG, "action backlog full, applying the oldest action without waiting for the link");
+        action_apply(&state, backlog[backlog_head].action, backlog[backlog_head].pressed);
+        backlog_head = (backlog_head + 1) % ACTION_BACKLOG;
+        backlog_count--;
+    }
+    backlog[(backlog_head + backlog_count) % ACTION_BACKLOG].action = action;
+    backlog[(backlog_head + backlog_count) % ACTION_BACKLOG].pressed = pressed;
+    backlog_count++;
+    apply_actions();
+}
 
-        if (memcmp(prev_kbdcmd, kbdcmd, sizeof(kbdcmd)) == 0)
+static void tap_hold_timer_callback(void *arg)
+{
+    xTaskNotifyGive((TaskHandle_t)arg);
+}
+
+void input_test(void *pvParameters)
+{
+    key_event_t event;
+    action_init(&state);
+    layer_init(keymap, sizeof(keymap) / sizeof(keymap[0]));
+    tap_hold_init(&emit_action);
+    combo_init(combos, sizeof(combos) / sizeof(combos[0]), &tap_hold_event);
+    macro_init(macros, sizeof(macros) / sizeof(macros[0]), &send_macro_report);
+    reporter_task = xTaskGetCurrentTaskHandle();
+
+    // wakes the task when the term of a held back combo key or a pending tap-hold key runs out,
+    // when the connection has been idle long enough to relax its parameters or when the
+    // directed advertising to the selected host is over
+    const esp_timer_create_args_t timer_args = {
+        .callback = &tap_hold_timer_callback,
+        .arg = reporter_task,
+        .name = "tap_hold"};
+    esp_timer_handle_t timer;
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+
+    key_event_set_consumer(reporter_task);
+    while (true)
+    {
+        // the scanner notifies us after pushing the events of one scan, the
+        // Bluetooth task whenever the stack confirmed a notification
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        // a confirmation made room for the reports the actions wait for
+        apply_actions();
+        // key events wait in their ring while actions wait for the link and while a
+        // macro types, the keys tapped meanwhile follow the macro in their order
+        while (backlog_count == 0 && !macro_running() && key_event_pop(&event))
+        {
+            conn_params_activity(event.time);
+            combo_event(&event);
+        }
+        int64_t now = esp_timer_get_time();
+        if (macro_running())
+        {
+            conn_params_activity(now);
+        }
+        int64_t combo_deadline = combo_tick(now);
+        int64_t conn_deadline = conn_params_tick(now);
+        int64_t host_deadline = host_tick(now);
+        int64_t deadline = tap_hold_tick(now);
+        if (combo_deadline < deadline)
+        {
+            deadline = combo_deadline;
+        }
+        if (conn_deadline < deadline)
+        {
+            deadline = conn_deadline;
+        }
+        if (host_deadline < deadline)
         {
-            if (memcmp(&prev_modifier, &modifier, sizeof(modifier)) == 0)
+            deadline = host_deadline;
+        }
+        send_reports();
+        if (sec_conn)
+        {
+            esp_hidd_flush(hid_conn_id);
+        }
+        if (macro_running())
+        {
+            macro_run();
+            if (!macro_running())
             {
-                continue;
+                // hand the report back to the keys that are held now
+                macro_sent = (macro_report_t){0, KC_NO};
+                state.keyboard_changed = REPORT_CHANGED_NKRO | REPORT_CHANGED_BOOT;
+                send_reports();
+                // take the key events that waited for the macro
+                xTaskNotifyGive(reporter_task);
             }
         }
-        memcpy(prev_kbdcmd, kbdcmd, sizeof(kbdcmd));
-        memcpy(&prev_modifier, &modifier, sizeof(modifier));
-        esp_hidd_send_keyboard_value(hid_conn_id, modifier.Value, kbdcmd, ndown);
+
+        esp_timer_stop(timer);
+        if (deadline != INT64_MAX)
+        {
+            ESP_ERROR_CHECK(esp_timer_start_once(timer, deadline - now));
+        }
     }
 }
 
@@ -508,17 +802,17 @@ void init_reporter()
         ESP_LOGI("MAIN", "bt device name is: %s", config.bt_device_name);
 
     ret = nvs_get_u8(my_handle, "locale", &config.locale);
-    //if(ret != ESP_OK || config.locale >= LAYOUT_MAX)
-    ///@todo implement keyboard layouts.
-    if (ret != ESP_OK)
+    if (ret != ESP_OK || config.locale >= LAYOUT_MAX)
     {
-        ESP_LOGI("MAIN", "error reading NVS - locale, setting to US_INTERNATIONAL");
-        //config.locale = LAYOUT_US_INTERNATIONAL;
+        ESP_LOGI("MAIN", "error reading NVS - locale, setting to US");
+        config.locale = LAYOUT_US;
     }
     else
         ESP_LOGI("MAIN", "locale code is : %d", config.locale);
     nvs_close(my_handle);
-    ///@todo How to handle the locale here? We have the memory for full lookups on the ESP32, but how to communicate this with the Teensy?
+    // text macros type with the keystrokes of the host's layout
+    layout_select(config.locale);
+    host_init(&hidd_adv_params);
 
     ///register the callback function to the gap module
     esp_ble_gap_register_callback(gap_event_handler);
@@ -544,5 +838,5 @@ void init_reporter()
     //xTaskCreate(&uart_external_task, "external", 4096, NULL, configMAX_PRIORITIES, NULL);
     ///@todo maybe reduce stack size for blink task? 4k words for blinky :-)?
     //xTaskCreate(&blink_task, "blink", 4096, NULL, configMAX_PRIORITIES, NULL);
-    xTaskCreate(&input_test, "input_test", 4096, NULL, configMAX_PRIORITIES, NULL);
+    xTaskCreatePinnedToCore(&input_test, "input_test", 4096, NULL, REPORTER_TASK_PRIORITY, NULL, INPUT_TASK_CORE);
 }
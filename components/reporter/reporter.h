@@ -1,3 +1,6 @@
+#ifndef _REPORTER_H_
+#define _REPORTER_H_
+
 #include "esp_err.h"
 #include "esp_log.h"
 
@@ -12,7 +15,8 @@
 
 void init_reporter();
 
-#define LEFT false
+/** @brief Priority of the report task, it runs on INPUT_TASK_CORE next to the scan task. */
+#define REPORTER_TASK_PRIORITY (configMAX_PRIORITIES - 3)
 
 typedef union
 {
@@ -212,4 +216,6 @@ enum hid_keyboard_keypad_usage
     KC_RGUI,
 
     /* NOTE: 0xE8-FF are used for internal special purpose */
-};
\ No newline at end of file
+};
+
+#endif
@@ -0,0 +1,161 @@
+#include <string.h>
+
+#include "tap_hold.h"
+#include "layer.h"
+
+#define TAP_HOLD_TERM_US (TAP_HOLD_TERM_MS * 1000LL)
+
+enum
+{
+    UNDECIDED,
+    TAP,
+    HOLD,
+};
+
+static tap_hold_emit_t tap_hold_emit;
+// events after the press of the pending key, oldest first, and their action if it is already known
+static key_event_t buffer[TAP_HOLD_BUFFER];
+static action_t buffer_action[TAP_HOLD_BUFFER];
+static int nbuffer;
+static bool pending;
+static uint8_t pending_key;
+static action_t pending_action;
+static int64_t pending_time;
+static uint8_t decision[NBUTTON]; // TAP or HOLD of every held tap-hold key
+
+void tap_hold_init(tap_hold_emit_t emit)
+{
+    tap_hold_emit = emit;
+    nbuffer = 0;
+    pending = false;
+    memset(decision, UNDECIDED, sizeof(decision));
+}
+
+static bool is_tap_hold(action_t action)
+{
+    return ACTION_KIND(action) >= ACTION_LMOD_TAP && ACTION_KIND(action) <= ACTION_LAYER_TAP;
+}
+
+/** @brief The action a tap-hold key stands for once it is decided. */
+static action_t tap_hold_action(action_t action, uint8_t how)
+{
+    if (how == TAP)
+    {
+        return ACTION(ACTION_KEY, action & 0xff);
+    }
+    switch (ACTION_KIND(action))
+    {
+    case ACTION_LMOD_TAP:
+        return ACTION(ACTION_LMODS, action & 0xf00);
+    case ACTION_RMOD_TAP:
+        return ACTION(ACTION_RMODS, action & 0xf00);
+    default:
+        return MO((action >> 8) & 0xf);
+    }
+}
+
+/** @brief Look through the buffered events for the first one that decides the pending key. */
+static uint8_t tap_hold_settle(int64_t now)
+{
+    for (int i = 0; i < nbuffer; i++)
+    {
+        const key_event_t *event = &buffer[i];
+        if (event->time - pending_time >= TAP_HOLD_TERM_US)
+        {
+            // the term ran out before this event
+            return HOLD;
+        }
+        if (event->key == pending_key)
+        {
+            if (!event->pressed)
+            {
+                return TAP;
+            }
+            continue;
+        }
+        if (event->pressed && TAP_HOLD_ON_OTHER_KEY_PRESS)
+        {
+            return HOLD;
+        }
+        if (!event->pressed && TAP_HOLD_PERMISSIVE)
+        {
+            // a key pressed and released while the tap-hold key is held
+            for (int j = 0; j < i; j++)
+            {
+                if (buffer[j].key == event->key && buffer[j].pressed)
+                {
+                    return HOLD;
+                }
+            }
+        }
+    }
+    if (now - pending_time >= TAP_HOLD_TERM_US || nbuffer == TAP_HOLD_BUFFER)
+    {
+        return HOLD;
+    }
+    return UNDECIDED;
+}
+
+/** @brief Pass the buffered events on, until a tap-hold key has to wait for its decision. */
+static void tap_hold_run(int64_t now)
+{
+    while (true)
+    {
+        if (pending)
+        {
+            uint8_t how = tap_hold_settle(now);
+            if (how == UNDECIDED)
+            {
+                return;
+            }
+            pending = false;
+            decision[pending_key] = how;
+            tap_hold_emit(tap_hold_action(pending_action, how), true);
+        }
+        if (nbuffer == 0)
+        {
+            return;
+        }
+        key_event_t event = buffer[0];
+        action_t action = buffer_action[0];
+        nbuffer--;
+        memmove(buffer, buffer + 1, nbuffer * sizeof(buffer[0]));
+        memmove(buffer_action, buffer_action + 1, nbuffer * sizeof(buffer_action[0]));
+
+        // resolved here and not when the event came in: a layer-tap hold applies to the buffered keys
+        if (action == KC_NO)
+        {
+            action = layer_apply(event.key, event.pressed);
+        }
+        if (!is_tap_hold(action))
+        {
+            tap_hold_emit(action, event.pressed);
+        }
+        else if (event.pressed)
+        {
+            pending = true;
+            pending_key = event.key;
+            pending_action = action;
+            pending_time = event.time;
+        }
+        else
+        {
+            tap_hold_emit(tap_hold_action(action, decision[event.key]), false);
+            decision[event.key] = UNDECIDED;
+        }
+    }
+}
+
+void tap_hold_event(const key_event_t *event, action_t action)
+{
+    // never full here, a pending key is decided as soon as the buffer fills up
+    buffer[nbuffer] = *event;
+    buffer_action[nbuffer++] = action;
+    tap_hold_run(event->time);
+}
+
+int64_t tap_hold_tick(int64_t now)
+{
+    tap_hold_run(now);
+    return pending ? pending_time + TAP_HOLD_TERM_US : INT64_MAX;
+}
@@ -0,0 +1,46 @@
+#ifndef _TAP_HOLD_H_
+#define _TAP_HOLD_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+#include "key_event.h"
+#include "action.h"
+
+/** @brief Time in milliseconds a tap-hold key has to be held to become a hold. */
+#define TAP_HOLD_TERM_MS 200
+/** @brief Hold as soon as another key is pressed and released while the tap-hold key is held,
+ * even within TAP_HOLD_TERM_MS. Keys that only roll over the tap-hold key stay taps. */
+#define TAP_HOLD_PERMISSIVE true
+/** @brief Hold as soon as another key is pressed while the tap-hold key is held. */
+#define TAP_HOLD_ON_OTHER_KEY_PRESS false
+/** @brief Events buffered while a key is undecided, a full buffer decides for hold. */
+#define TAP_HOLD_BUFFER 16
+
+/** @brief Mod-tap and layer-tap keys: the keycode on tap, modifiers or a layer while held.
+ *
+ * E.g. LMT(MOD_SHIFT, KC_F) for a home row shift, LT(1, KC_SPACE). */
+#define LMT(mods, keycode) ACTION(ACTION_LMOD_TAP, (mods) << 8 | (keycode))
+#define RMT(mods, keycode) ACTION(ACTION_RMOD_TAP, (mods) << 8 | (keycode))
+#define LT(layer, keycode) ACTION(ACTION_LAYER_TAP, (layer) << 8 | (keycode))
+
+/** @brief Receives the decided actions, in the order they take effect. */
+typedef void (*tap_hold_emit_t)(action_t action, bool pressed);
+
+void tap_hold_init(tap_hold_emit_t emit);
+
+/** @brief Resolve a key event through the layers (layer.h) and pass the action on to emit.
+ *
+ * After the press of a tap-hold key, the following events are held back until the key is
+ * decided. The decision only depends on the event timestamps, and is made with the
+ * first event that settles it.
+ *
+ * @param action KC_NO to resolve the key through the layers, or the action of a combo (combo.h) */
+void tap_hold_event(const key_event_t *event, action_t action);
+
+/** @brief Decide a pending key whose tapping term has run out by now.
+ *
+ * @return esp_timer time to call again at, INT64_MAX if no key is pending */
+int64_t tap_hold_tick(int64_t now);
+
+#endif
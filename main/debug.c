@@ -1,5 +1,28 @@
+#include <stdio.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
 #include "esp_system.h"
 #include "esp_spi_flash.h"
+#include "esp_timer.h"
+#include "esp_cpu.h"
+#include "esp_log.h"
+
+#include "input_matrix.h"
+#include "matrix_backend.h"
+#include "debounce.h"
+#include "key_event.h"
+#include "scan_timer.h"
+#include "report_builder.h"
+#include "layer.h"
+#include "tap_hold.h"
+#include "combo.h"
+#include "layout.h"
+#include "macro.h"
+#include "esp_hidd_prf_api.h"
+#include "hid_dev.h"
 
 void output_chip_info(){
     /* Print chip information */
@@ -14,4 +37,601 @@ void output_chip_info(){
 
     printf("%dMB %s flash\n", spi_flash_get_chip_size() / (1024 * 1024),
             (chip_info.features & CHIP_FEATURE_EMB_FLASH) ? "embedded" : "external");
-}
\ No newline at end of file
+}
+
+static TaskHandle_t bench_task = NULL;
+
+static void bench_timer_callback(void *arg)
+{
+    xTaskNotifyGive(bench_task);
+}
+
+/** @brief Measure the duration of scan_input() and the period jitter at INPUT_SCAN_RATE_HZ.
+ *
+ * Runs count back-to-back scans first, then count timer paced scans,
+ * and prints min/avg/max for both. */
+void bench_scan_input(int count){
+    int64_t min = INT64_MAX, max = 0, sum = 0;
+    for(int i = 0; i < count; i++){
+        int64_t start = esp_timer_get_time();
+        scan_input();
+        int64_t duration = esp_timer_get_time() - start;
+        if(duration < min) min = duration;
+        if(duration > max) max = duration;
+        sum += duration;
+    }
+    printf("scan duration: min %lldus avg %lldus max %lldus\n", min, sum / count, max);
+
+    bench_task = xTaskGetCurrentTaskHandle();
+    const esp_timer_create_args_t timer_args = {
+        .callback = &bench_timer_callback,
+        .name = "scan_bench"};
+    esp_timer_handle_t timer;
+    ESP_ERROR_CHECK(esp_timer_create(&timer_args, &timer));
+    ESP_ERROR_CHECK(esp_timer_start_periodic(timer, INPUT_SCAN_PERIOD_US));
+
+    min = INT64_MAX; max = 0; sum = 0;
+    ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    int64_t last = esp_timer_get_time();
+    for(int i = 0; i < count; i++){
+        ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+        int64_t now = esp_timer_get_time();
+        scan_input();
+        int64_t period = now - last;
+        last = now;
+        if(period < min) min = period;
+        if(period > max) max = period;
+        sum += period;
+    }
+    ESP_ERROR_CHECK(esp_timer_stop(timer));
+    ESP_ERROR_CHECK(esp_timer_delete(timer));
+    printf("scan period (target %dus): min %lldus avg %lldus max %lldus, jitter %lldus\n",
+            INPUT_SCAN_PERIOD_US, min, sum / count, max, max - min);
+}
+
+
+/** @brief Contact waveforms sampled once per scan, '1' is closed.
+ *
+ * Each one is a single press and release with the bounce patterns of worn switches. */
+static const char *bounce_waveforms[] = {
+    "0000010110111111111111111111111111111111111110100100000000000000000000",
+    "0000001011011101111111111111111111111111111111110111010010000000000000",
+    "0000000111111111111111111111111111111101111111111111100000000000000000",
+    "0000001010101011111111111111111111111111111101010101000000000000000000",
+};
+
+/** @brief Replay bounce_waveforms through every debounce algorithm.
+ *
+ * Prints the added press/release latency in scans and the number of extra
+ * (chattering) transitions the algorithm let through. */
+void bench_debounce(){
+    static const char *names[] = {"eager", "defer", "asym"};
+    for(int algorithm = DEBOUNCE_EAGER; algorithm <= DEBOUNCE_ASYM; algorithm++){
+        int press_latency = 0, release_latency = 0, chatter = 0;
+        for(int w = 0; w < sizeof(bounce_waveforms) / sizeof(bounce_waveforms[0]); w++){
+            static debounce_t db;
+            debounce_init(&db, algorithm, INPUT_DEBOUNCE_PRESS_SCANS, INPUT_DEBOUNCE_RELEASE_SCANS);
+            const char *wave = bounce_waveforms[w];
+            int first_close = -1, first_open = -1, pressed_at = -1, released_at = -1, transitions = 0, closed = 0;
+            for(int t = 0; wave[t]; t++){
+                matrix_row_t raw[NROW] = {0};
+                matrix_row_t out[NROW];
+                raw[0] = wave[t] == '1';
+                if(raw[0] && first_close < 0) first_close = t;
+                // the release edge is the first open sample after the contact was closed for a while
+                if(!raw[0] && first_open < 0 && closed >= 10) first_open = t;
+                closed = raw[0] ? closed + 1 : 0;
+                if(debounce_update(&db, raw, out)){
+                    transitions++;
+                    if(out[0] && pressed_at < 0) pressed_at = t;
+                    if(!out[0] && released_at < 0 && first_open >= 0) released_at = t;
+                }
+            }
+            press_latency += pressed_at - first_close;
+            release_latency += released_at - first_open;
+            chatter += transitions - 2;
+        }
+        int n = sizeof(bounce_waveforms) / sizeof(bounce_waveforms[0]);
+        printf("debounce %s: press latency %d.%02d scans, release latency %d.%02d scans, chatter %d\n",
+                names[algorithm], press_latency / n, press_latency * 100 / n % 100,
+                release_latency / n, release_latency * 100 / n % 100, chatter);
+    }
+}
+
+/** @brief Measure how many key events per second report_apply() handles.
+ *
+ * Replays rolling typing with modifiers mixed in: every step presses a key and
+ * releases the one pressed four steps earlier. */
+void bench_report_builder(int count){
+    static const uint8_t codes[] = {KC_A, KC_LSHIFT, KC_S, KC_D, KC_F, KC_SPACE, KC_J, KC_K, KC_LCTRL, KC_L};
+    const int n = sizeof(codes);
+    static keyboard_report_t report;
+    report_init(&report);
+    int reports = 0;
+    int64_t start = esp_timer_get_time();
+    for(int i = 0; i < count; i++){
+        reports += report_apply(&report, codes[i % n], true) != 0;
+        reports += report_apply(&report, codes[(i + n - 4) % n], false) != 0;
+    }
+    int64_t duration = esp_timer_get_time() - start;
+    if(duration == 0){
+        duration = 1;
+    }
+    printf("report builder: %d events in %lldus, %lld events/s, %d reports\n",
+            2 * count, duration, 2LL * count * 1000000 / duration, reports);
+}
+
+/* Keymap of the tap-hold replay: key 0 is shift on hold, key 1 layer 1 on hold. */
+static action_t replay_base[NBUTTON] = {LMT(MOD_SHIFT, KC_A), LT(1, KC_SPACE), KC_B, KC_D};
+static action_t replay_fn[NBUTTON] = {KC_TRANSPARENT, KC_TRANSPARENT, KC_C, KC_TRANSPARENT};
+static const action_t *const replay_keymap[] = {replay_base, replay_fn};
+
+/** @brief Key event traces, "<key><+|-><time ms>", and the exact output for the default policies
+ * (TAP_HOLD_TERM_MS 200, TAP_HOLD_PERMISSIVE, not TAP_HOLD_ON_OTHER_KEY_PRESS). */
+static const struct {
+    const char *events;
+    const char *output;
+} tap_hold_traces[] = {
+    {"0+0 0-100", "+a -a"},                                         // tap
+    {"0+0 0-300", "+shift -shift"},                                 // held past the term
+    {"0+0 2+50 0-80 2-120", "+a +b -a -b"},                         // rollover stays a tap
+    {"0+0 2+50 2-90 0-150", "+shift +b -b -shift"},                 // permissive hold
+    {"0+0 2+50 0-300 2-350", "+shift +b -shift -b"},                // the term runs out with b held
+    {"1+0 2+40 2-80 1-150", "+L1 +c -c -L1"},                       // layer-tap hold, b resolves on layer 1
+    {"1+0 1-90 2+120 2-160", "+space -space +b -b"},                // layer-tap tap
+    {"0+0 1+30 2+60 2-90 1-120 0-150", "+shift +L1 +c -c -L1 -shift"}, // nested holds
+    {"0+0 0-50 3+60 3-100", "+a -a +d -d"},                         // fast typing after a tap
+};
+
+static char replay_output[128];
+
+static void replay_emit(action_t action, bool pressed){
+    static const struct {
+        action_t action;
+        const char *name;
+    } names[] = {
+        {KC_A, "a"}, {KC_B, "b"}, {KC_C, "c"}, {KC_D, "d"}, {KC_SPACE, "space"},
+        {LMODS(MOD_SHIFT, KC_NO), "shift"}, {MO(1), "L1"},
+    };
+    const char *name = "?";
+    for(int i = 0; i < sizeof(names) / sizeof(names[0]); i++){
+        if(names[i].action == action){
+            name = names[i].name;
+        }
+    }
+    // layer keys have to take effect, or the keys after them resolve on the wrong layer
+    if(ACTION_KIND(action) == ACTION_LAYER){
+        layer_action(action, pressed);
+    }
+    size_t len = strlen(replay_output);
+    snprintf(replay_output + len, sizeof(replay_output) - len, "%s%c%s", len ? " " : "", pressed ? '+' : '-', name);
+}
+
+/** @brief Replay tap_hold_traces through the tap-hold engine and compare the output.
+ *
+ * Reinitializes the layer and tap-hold engines, call it before init_reporter(). */
+void test_tap_hold(){
+#if TAP_HOLD_TERM_MS != 200 || !TAP_HOLD_PERMISSIVE || TAP_HOLD_ON_OTHER_KEY_PRESS
+    printf("tap-hold replay: the traces expect the default tap-hold configuration\n");
+#endif
+    int passed = 0, n = sizeof(tap_hold_traces) / sizeof(tap_hold_traces[0]);
+    for(int t = 0; t < n; t++){
+        layer_init(replay_keymap, 2);
+        tap_hold_init(&replay_emit);
+        replay_output[0] = 0;
+        const char *p = tap_hold_traces[t].events;
+        int64_t time = 0;
+        while(*p){
+            key_event_t event;
+            char *end;
+            event.key = strtol(p, &end, 10);
+            event.pressed = *end == '+';
+            event.time = time = strtoll(end + 1, &end, 10) * 1000;
+            // the timer would have fired in between
+            tap_hold_tick(time);
+            tap_hold_event(&event, KC_NO);
+            p = *end ? end + 1 : end;
+        }
+        tap_hold_tick(time + TAP_HOLD_TERM_MS * 1000LL);
+        if(strcmp(replay_output, tap_hold_traces[t].output) == 0){
+            passed++;
+        } else {
+            printf("tap-hold trace \"%s\": expected \"%s\", got \"%s\"\n",
+                    tap_hold_traces[t].events, tap_hold_traces[t].output, replay_output);
+        }
+    }
+    printf("tap-hold replay: %d/%d traces pass\n", passed, n);
+}
+
+static int bench_emitted;
+
+static void bench_combo_emit(const key_event_t *event, action_t action){
+    bench_emitted++;
+}
+
+/** @brief Time count press/release pairs of keys through combo_event(), in ns per event. */
+static int64_t bench_combo_keys(int count, int first_key, int nkeys){
+    int64_t start = esp_timer_get_time();
+    for(int i = 0; i < count; i++){
+        key_event_t event = {.time = i * 1000LL, .key = first_key + i % nkeys, .pressed = true};
+        combo_event(&event);
+        event.pressed = false;
+        combo_event(&event);
+    }
+    return (esp_timer_get_time() - start) * 1000 / (2 * count);
+}
+
+/** @brief Measure the per event cost of the combo engine with ncombos combos.
+ *
+ * The combos use the keys of the first half of the matrix only, the keys of the
+ * second half belong to no combo and have to cost the same with and without combos. */
+void bench_combo(int count, int ncombos){
+    static combo_t combos[COMBO_MAX];
+    if(ncombos > COMBO_MAX){
+        ncombos = COMBO_MAX;
+    }
+    int half = NBUTTON / 2;
+    uint32_t seed = 1;
+    for(int c = 0; c < ncombos; c++){
+        combos[c].nkeys = 2 + c % (COMBO_MAX_KEYS - 1);
+        for(int i = 0; i < combos[c].nkeys; i++){
+            seed = seed * 1103515245 + 12345;
+            combos[c].keys[i] = (seed >> 16) % half;
+        }
+        combos[c].action = KC_A + c % 26;
+        combos[c].term_ms = 0;
+    }
+
+    combo_init(combos, 0, &bench_combo_emit);
+    int64_t baseline = bench_combo_keys(count, half, NBUTTON - half);
+    combo_init(combos, ncombos, &bench_combo_emit);
+    int64_t other = bench_combo_keys(count, half, NBUTTON - half);
+    int64_t members = bench_combo_keys(count, 0, half);
+    printf("combos: %d combos, keys without combos %lldns/event (%lldns without any combos), keys with combos %lldns/event\n",
+            ncombos, other, baseline, members);
+}
+
+static int macro_link_queued;
+static int macro_link_reports;
+
+/** @brief Simulated link, takes reports while fewer than HIDD_NTF_IN_FLIGHT are unconfirmed like esp_hidd_send_ready(). */
+static bool bench_macro_send(const macro_report_t *report){
+    if(macro_link_queued >= HIDD_NTF_IN_FLIGHT){
+        return false;
+    }
+    macro_link_queued++;
+    macro_link_reports++;
+    return true;
+}
+
+/** @brief Type nchars of text on the US layout over a simulated link that sends up to
+ * per_event notifications every interval_us, and print the typing rate. */
+void bench_macro(int nchars, int per_event, int interval_us){
+    static const char pangram[] = "The quick brown fox jumps over the lazy dog, 1234567890 times! ";
+    char *text = malloc(nchars + 1);
+    for(int i = 0; i < nchars; i++){
+        text[i] = pangram[i % (sizeof(pangram) - 1)];
+    }
+    text[nchars] = '\0';
+    layout_select(LAYOUT_US);
+    macro_init(NULL, 0, &bench_macro_send);
+    macro_link_queued = 0;
+    macro_link_reports = 0;
+    macro_type(text);
+
+    int events = 0;
+    int64_t start = esp_timer_get_time();
+    macro_run();
+    while(macro_running()){
+        // one connection event, every notification that goes out is confirmed and runs the macro again
+        for(int i = 0; i < per_event && macro_link_queued > 0; i++){
+            macro_link_queued--;
+            macro_run();
+        }
+        events++;
+    }
+    int64_t cpu = esp_timer_get_time() - start;
+    int64_t link_us = (int64_t)events * interval_us;
+    // before the macro engine every report waited for the next 10ms loop, with a release after every key
+    printf("macro: %d chars in %d reports and %d connection events of %dus, %lld chars/s (50 chars/s one report per 10ms), %lldns cpu per report\n",
+            nchars, macro_link_reports, events, interval_us, nchars * 1000000LL / link_us, cpu * 1000 / macro_link_reports);
+    free(text);
+}
+
+#if CONFIG_SEND_BENCHMARK
+/* Entries of hid_add_id_tbl() in its order, the handles don't matter to the counted notifications. */
+static hid_report_map_t bench_rpt_map[HID_NUM_REPORTS] = {
+    {.id = HID_RPT_ID_KEY_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    {.id = HID_RPT_ID_CC_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    {.id = HID_RPT_ID_LED_OUT, .type = HID_REPORT_TYPE_OUTPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    {.id = HID_RPT_ID_MOUSE_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+    {.id = HID_RPT_ID_KEY_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_BOOT},
+    {.id = HID_RPT_ID_LED_OUT, .type = HID_REPORT_TYPE_OUTPUT, .mode = HID_PROTOCOL_MODE_BOOT},
+    {.id = HID_RPT_ID_MOUSE_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_BOOT},
+    {.id = HID_RPT_ID_FEATURE, .type = HID_REPORT_TYPE_FEATURE, .mode = HID_PROTOCOL_MODE_REPORT},
+    {.id = HID_RPT_ID_NKRO_IN, .type = HID_REPORT_TYPE_INPUT, .mode = HID_PROTOCOL_MODE_REPORT},
+};
+
+/* bench_report_send() counts the notifications instead of handing them to the stack,
+ * main/CMakeLists.txt links esp_ble_gatts_send_indicate() through this wrapper with CONFIG_SEND_BENCHMARK. */
+static bool bench_send_stubbed;
+static uint32_t bench_notifications;
+
+esp_err_t __real_esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t attr_handle,
+                                             uint16_t value_len, uint8_t *value, bool need_confirm);
+
+esp_err_t __wrap_esp_ble_gatts_send_indicate(esp_gatt_if_t gatts_if, uint16_t conn_id, uint16_t attr_handle,
+                                             uint16_t value_len, uint8_t *value, bool need_confirm){
+    if(bench_send_stubbed){
+        bench_notifications++;
+        return ESP_OK;
+    }
+    return __real_esp_ble_gatts_send_indicate(gatts_if, conn_id, attr_handle, value_len, value, need_confirm);
+}
+
+/** @brief CPU cycles per report of count reports, alternating between a press and a release.
+ *
+ * direct: every report is confirmed before the next one, so it goes straight to the stack.
+ * Otherwise the link is congested while a press and its release are queued, and the time
+ * includes the flush that sends both once the congestion ended. */
+static uint32_t bench_send(hidd_clcb_t *p_clcb, uint16_t conn_id, bool nkro, bool direct, int count){
+    static const uint8_t boot[2][HID_KEYBOARD_IN_RPT_LEN] = {{LEFT_SHIFT_KEY_MASK, 0, KC_A, KC_S, KC_D}, {0}};
+    static const uint8_t bitmap[2][HID_NKRO_IN_RPT_LEN] = {{0x0f}, {0}};
+    uint32_t start = esp_cpu_get_ccount();
+    for(int i = 0; i < count; i++){
+        if(!direct && i % 2 == 0){
+            p_clcb->congest = true;
+        }
+        if(nkro){
+            esp_hidd_send_nkro_value(conn_id, bitmap[i % 2]);
+        } else {
+            esp_hidd_send_keyboard_report(conn_id, boot[i % 2]);
+        }
+        if(!direct && i % 2 == 1){
+            p_clcb->congest = false;
+            esp_hidd_flush(conn_id);
+        }
+        // the confirmations of the Bluetooth task
+        p_clcb->ntf_confirmed = p_clcb->ntf_stats.sent;
+    }
+    return (esp_cpu_get_ccount() - start) / count;
+}
+
+/** @brief Print the CPU cycles per 6KRO and NKRO report of the send path, from the send function
+ * to esp_ble_gatts_send_indicate(), straight to the stack and through the queue.
+ *
+ * Runs before the profile is up, on a link of its own that is removed again. */
+void bench_report_send(int count){
+    const uint16_t conn_id = 0;
+    esp_bd_addr_t bda = {0};
+    hid_dev_register_reports(HID_NUM_REPORTS, bench_rpt_map);
+    hidd_clcb_alloc(conn_id, bda);
+    hidd_clcb_t *p_clcb = hidd_clcb_find(conn_id);
+    if(p_clcb == NULL){
+        return;
+    }
+    bench_send_stubbed = true;
+    bench_notifications = 0;
+    uint32_t boot_direct = bench_send(p_clcb, conn_id, false, true, count);
+    uint32_t boot_queued = bench_send(p_clcb, conn_id, false, false, count);
+    uint32_t nkro_direct = bench_send(p_clcb, conn_id, true, true, count);
+    uint32_t nkro_queued = bench_send(p_clcb, conn_id, true, false, count);
+    bench_send_stubbed = false;
+    hidd_clcb_dealloc(conn_id);
+    printf("report send: 6KRO %u cycles direct, %u queued, NKRO %u cycles direct, %u queued, %u/%d notifications\n",
+            boot_direct, boot_queued, nkro_direct, nkro_queued, bench_notifications, 4 * count);
+}
+#endif
+
+#if BOARD_BACKEND == MATRIX_BACKEND_SHIFT_REG && BOARD_SR_MOCK
+#if BOARD_SR_DRIVE_COLS
+// one transfer per column after the one that shifts in the first pattern, a row bit per 165 input
+#define SR_TEST_TRANSFERS (NCOL + 1)
+#define SR_TEST_LEN ((NROW_BACKEND + 7) / 8)
+#else
+// a single transfer, a bit per key
+#define SR_TEST_TRANSFERS 1
+#define SR_TEST_LEN (NROW_BACKEND * NCOL / 8)
+#endif
+static uint8_t sr_test_rx[SR_TEST_TRANSFERS * SR_TEST_LEN];
+
+/** @brief Pull the 165 input of key (row, col) low in sr_test_rx, as the chain reads a pressed key. */
+static void sr_test_press(int row, int col){
+#if BOARD_SR_DRIVE_COLS
+    sr_test_rx[(col + 1) * SR_TEST_LEN + row / 8] &= ~(1 << (row % 8));
+#else
+    int n = row * NCOL + col;
+    sr_test_rx[n / 8] &= ~(1 << (n % 8));
+#endif
+}
+
+/** @brief Read sr_test_rx through matrix_backend_read() and compare the backend rows with expected. */
+static bool sr_test_read(const char *name, const matrix_row_t expected[NROW]){
+    matrix_row_t state[NROW] = {0};
+    sr_mock_feed(sr_test_rx, SR_TEST_TRANSFERS, SR_TEST_LEN);
+    matrix_backend_read(state);
+    for(int r = 0; r < NROW_BACKEND; r++){
+        if(state[r] != expected[r]){
+            printf("shift register %s: row %d is 0x%llx, expected 0x%llx\n",
+                    name, r, (unsigned long long)state[r], (unsigned long long)expected[r]);
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/** @brief Feed canned 165 chain bytes through matrix_backend_read() and check the decoded rows:
+ * nothing pressed, every single key and every key at once, which must not set bits past NCOL.
+ *
+ * Needs the shift register backend with BOARD_SR_MOCK, the scanner reads the mock as well. */
+void test_shift_reg(){
+#if BOARD_BACKEND == MATRIX_BACKEND_SHIFT_REG && BOARD_SR_MOCK
+    matrix_row_t expected[NROW] = {0};
+    int passed = 0, n = 0;
+
+    memset(sr_test_rx, 0xff, sizeof(sr_test_rx));
+    passed += sr_test_read("released", expected);
+    n++;
+
+    for(int r = 0; r < NROW_BACKEND; r++){
+        for(int c = 0; c < NCOL; c++){
+            char name[32];
+            snprintf(name, sizeof(name), "key %d,%d", r, c);
+            memset(sr_test_rx, 0xff, sizeof(sr_test_rx));
+            sr_test_press(r, c);
+            expected[r] = (matrix_row_t)1 << c;
+            passed += sr_test_read(name, expected);
+            expected[r] = 0;
+            n++;
+        }
+    }
+
+    // all inputs low, including the unused 165 inputs of the drive mode
+    memset(sr_test_rx, 0, sizeof(sr_test_rx));
+    for(int r = 0; r < NROW_BACKEND; r++){
+        expected[r] = (matrix_row_t)(~0ULL >> (64 - NCOL));
+    }
+    passed += sr_test_read("all pressed", expected);
+    n++;
+    printf("shift register decode: %d/%d reads pass\n", passed, n);
+#else
+    printf("shift register decode: needs BOARD_BACKEND MATRIX_BACKEND_SHIFT_REG and BOARD_SR_MOCK\n");
+#endif
+}
+
+#if NEXPANDER && BOARD_EXPANDER_SIM
+/** @brief Read the expanders and compare their rows with the expander inputs in keys, bit n for input n. */
+static bool expander_test_read(const char *name, uint64_t keys){
+    matrix_row_t state[NROW] = {0}, expected[NROW] = {0};
+    for(; keys; keys &= keys - 1){
+        int n = __builtin_ctzll(keys);
+        expected[NROW_BACKEND + n / NCOL] |= (matrix_row_t)1 << (n % NCOL);
+    }
+    expander_read(state);
+    for(int r = NROW_BACKEND; r < NROW; r++){
+        if(state[r] != expected[r]){
+            printf("expander %s: row %d is 0x%llx, expected 0x%llx\n",
+                    name, r, (unsigned long long)state[r], (unsigned long long)expected[r]);
+            return false;
+        }
+    }
+    return true;
+}
+#endif
+
+/** @brief Run the first simulated MCP23017 through a port A and a port B key, stopping to
+ * answer with a key held and coming back without its configuration.
+ *
+ * Needs BOARD_EXPANDER_SIM and at least one chip in BOARD_EXPANDERS, call it before setup_input(). */
+void test_expander(){
+#if NEXPANDER && BOARD_EXPANDER_SIM
+    int passed = 0, n = 0;
+    expander_setup();
+    passed += expander_test_read("released", 0);
+    n++;
+
+    // pin 3 of port A and pin 1 of port B of the first chip
+    expander_sim_set(0, 1 << 3 | 1 << 9);
+    passed += expander_pending() && expander_test_read("ports", 1 << 3 | 1 << 9);
+    n++;
+    // nothing changed, the keys stay pressed without a read
+    passed += !expander_pending() && expander_test_read("held", 1 << 3 | 1 << 9);
+    n++;
+    expander_sim_set(0, 1 << 9);
+    passed += expander_test_read("port A released", 1 << 9);
+    n++;
+
+    // the chip goes away with the key held and without a change on INT, the check of held keys notices it
+    expander_sim_fail(0, true);
+    vTaskDelay(pdMS_TO_TICKS(150));
+    passed += expander_test_read("lost", 0);
+    n++;
+    vTaskDelay(pdMS_TO_TICKS(600));
+    passed += expander_test_read("lost after a retry", 0);
+    n++;
+
+    // it comes back from its power-on state with a key held, the retry configures it again
+    expander_sim_fail(0, false);
+    expander_sim_set(0, 1 << 15);
+    vTaskDelay(pdMS_TO_TICKS(600));
+    passed += expander_test_read("back", 1 << 15);
+    n++;
+
+    for(int i = 0; i < NEXPANDER; i++){
+        expander_sim_set(i, 0);
+    }
+    passed += expander_test_read("released again", 0);
+    n++;
+    printf("expander simulation: %d/%d reads pass\n", passed, n);
+#else
+    printf("expander simulation: needs BOARD_EXPANDER_SIM and a chip in BOARD_EXPANDERS\n");
+#endif
+}
+
+void output_key_event_stats(){
+    uint32_t high_water, overflows;
+    key_event_stats(&high_water, &overflows);
+    printf("key events: high water %u/%d, overflows %u\n", high_water, KEY_EVENT_QUEUE_LEN, overflows);
+}
+
+/** @brief Print the scan period jitter histogram collected by scan_timer_wait(). */
+void output_scan_jitter(){
+    uint32_t bins[SCAN_JITTER_BINS], max;
+    scan_timer_jitter(bins, &max);
+    printf("scan jitter (period %dus, max %uus):\n", INPUT_SCAN_PERIOD_US, max);
+    for(int i = 0; i < SCAN_JITTER_BINS; i++){
+        if(bins[i] == 0){
+            continue;
+        }
+        if(i == 0){
+            printf("       0us: %u\n", bins[i]);
+        } else {
+            printf("  %4u-%4uus: %u\n", 1u << (i - 1), (1u << i) - 1, bins[i]);
+        }
+    }
+}
+
+#if CONFIG_FREERTOS_GENERATE_RUN_TIME_STATS
+#define MONITOR_MAX_TASKS 32
+
+static void task_monitor(void *pvParameters){
+    const TickType_t period = pdMS_TO_TICKS((intptr_t)pvParameters);
+    static TaskStatus_t prev[MONITOR_MAX_TASKS], curr[MONITOR_MAX_TASKS];
+    uint32_t prev_total = 0, curr_total;
+    UBaseType_t prev_count = uxTaskGetSystemState(prev, MONITOR_MAX_TASKS, &prev_total);
+    while(true){
+        vTaskDelay(period);
+        UBaseType_t curr_count = uxTaskGetSystemState(curr, MONITOR_MAX_TASKS, &curr_total);
+        // the counters run on every core, so the available time is portNUM_PROCESSORS times the elapsed time
+        uint32_t elapsed = (curr_total - prev_total) * portNUM_PROCESSORS;
+        printf("task            core prio   load\n");
+        for(int i = 0; i < curr_count && elapsed > 0; i++){
+            for(int j = 0; j < prev_count; j++){
+                if(prev[j].xHandle == curr[i].xHandle){
+                    uint32_t run = curr[i].ulRunTimeCounter - prev[j].ulRunTimeCounter;
+#if configTASKLIST_INCLUDE_COREID
+                    int core = curr[i].xCoreID == tskNO_AFFINITY ? -1 : curr[i].xCoreID;
+#else
+                    int core = -1; // xCoreID needs CONFIG_FREERTOS_VTASKLIST_INCLUDE_COREID
+#endif
+                    printf("%-16s %4d %4u %5.1f%%\n", curr[i].pcTaskName, core,
+                            curr[i].uxCurrentPriority, 100.0f * run / elapsed);
+                    break;
+                }
+            }
+        }
+        for(int i = 0; i < curr_count; i++){
+            prev[i] = curr[i];
+        }
+        prev_count = curr_count;
+        prev_total = curr_total;
+        output_scan_jitter();
+    }
+}
+
+/** @brief Print the CPU load of every task, including its core and priority, every period_ms. */
+void start_task_monitor(int period_ms){
+    xTaskCreatePinnedToCore(&task_monitor, "monitor", 3072, (void *)(intptr_t)period_ms, tskIDLE_PRIORITY + 1, NULL, PRO_CPU_NUM);
+}
+#endif
@@ -1,2 +1,13 @@
-
-void output_chip_info();
\ No newline at end of file
+void output_chip_info();
+void bench_scan_input(int count);
+void bench_debounce();
+void bench_report_builder(int count);
+void test_tap_hold();
+void test_shift_reg();
+void test_expander();
+void bench_combo(int count, int ncombos);
+void bench_macro(int nchars, int per_event, int interval_us);
+void bench_report_send(int count);
+void output_key_event_stats();
+void start_task_monitor(int period_ms);
+void output_scan_jitter();
@@ -9,39 +9,134 @@
 #include <stdio.h>
 #include "freertos/FreeRTOS.h"
 #include "freertos/task.h"
+#include "esp_timer.h"
+#include "esp_log.h"
 
 #include "input_matrix.h"
+#include "scan_timer.h"
 #include "debug.h"
 #include "reporter.h"
 
-void app_main(void)
-{
-    printf("Start App Main\n");
+#define MAIN_TAG "MAIN"
 
-    output_chip_info();
+/** @brief Set to true to print scan duration, period jitter and debounce latency on boot. */
+#define SCAN_BENCHMARK false
 
-    init_reporter();
-    setup_input();
+/** @brief Set to true to print how many key events per second the report builder handles on boot. */
+#define REPORT_BENCHMARK false
+
+/** @brief Set to true to replay the tap-hold traces in debug.c on boot and print the traces that fail. */
+#define TAP_HOLD_REPLAY false
+
+/** @brief Set to true to check the shift register decode on canned bytes on boot, needs BOARD_SR_MOCK in board.h. */
+#define SHIFT_REG_TEST false
+
+/** @brief Set to true to run the simulated port expanders through key changes, a lost and a recovered chip on boot,
+ * needs BOARD_EXPANDER_SIM in board.h. */
+#define EXPANDER_TEST false
 
+/** @brief Set to true to print the per event cost of the combo engine with a few hundred combos on boot. */
+#define COMBO_BENCHMARK false
+
+/** @brief Set to true to print how fast 1KB of text types over a simulated 7.5ms connection on boot. */
+#define MACRO_BENCHMARK false
+
+/* The report send benchmark is CONFIG_SEND_BENCHMARK in menuconfig, it changes how the firmware links. */
+
+/** @brief Set to true to print the per task CPU load and the scan jitter periodically, needs run time stats in sdkconfig. */
+#define TASK_MONITOR false
+#define TASK_MONITOR_PERIOD_MS 5000
+
+static void scan_loop(void *pvParameters)
+{
+    scan_timer_init();
+    scan_timer_start(INPUT_SCAN_PERIOD_US);
+
+    matrix_row_t prev[NROW] = {0};
+    int64_t last_active = esp_timer_get_time();
+    bool woken = false;
     while (true)
     {
+        if (!woken)
+        {
+            scan_timer_wait();
+        }
         scan_input();
+        int64_t now = esp_timer_get_time();
+        if (woken)
+        {
+            ESP_LOGI(MAIN_TAG, "wake to first scan: %lldus", now - input_wake_time());
+            woken = false;
+        }
 
         int down_count = 0;
-        for (int i = 0; i < NBUTTON; i++)
+        matrix_row_t changed = 0;
+        for (int i = 0; i < NROW; i++)
         {
-            if (input_buttons[i] == 1)
-            {
-                //printf("%d ", i);
-                down_count++;
-            }
+            changed |= input_matrix[i] ^ prev[i];
+            prev[i] = input_matrix[i];
+            down_count += __builtin_popcount(input_matrix[i]);
         }
 
-        if (down_count > 0)
+        if (changed && down_count > 0)
         {
-            //printf("\n");
+            //printf("%d keys down\n", down_count);
         }
 
-        vTaskDelay(10 / portTICK_PERIOD_MS);
+        if (down_count > 0)
+        {
+            last_active = now;
+        }
+        else if (now - last_active > INPUT_IDLE_TIMEOUT_MS * 1000)
+        {
+            // nothing pressed for a while, sleep until a row interrupt instead of polling
+            scan_timer_stop();
+            input_wait_for_key();
+            scan_timer_start(INPUT_SCAN_PERIOD_US);
+            last_active = esp_timer_get_time();
+            woken = true;
+        }
     }
-}
\ No newline at end of file
+}
+
+void app_main(void)
+{
+    printf("Start App Main\n");
+
+    output_chip_info();
+
+    // before the reporter, it sets up the layer, tap-hold, combo and macro engines and the report map again
+#if TAP_HOLD_REPLAY
+    test_tap_hold();
+#endif
+#if COMBO_BENCHMARK
+    bench_combo(100000, 300);
+#endif
+#if MACRO_BENCHMARK
+    bench_macro(1024, 4, 7500);
+#endif
+#if CONFIG_SEND_BENCHMARK
+    bench_report_send(10000);
+#endif
+#if EXPANDER_TEST
+    test_expander();
+#endif
+    init_reporter();
+    setup_input();
+
+#if SCAN_BENCHMARK
+    bench_scan_input(1000);
+    bench_debounce();
+#endif
+#if REPORT_BENCHMARK
+    bench_report_builder(100000);
+#endif
+#if SHIFT_REG_TEST
+    test_shift_reg();
+#endif
+#if TASK_MONITOR
+    start_task_monitor(TASK_MONITOR_PERIOD_MS);
+#endif
+
+    xTaskCreatePinnedToCore(&scan_loop, "scan", 4096, NULL, INPUT_SCAN_TASK_PRIORITY, NULL, INPUT_TASK_CORE);
+}